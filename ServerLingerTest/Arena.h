@@ -0,0 +1,73 @@
+#ifndef SERVER_LINGER_TEST_ARENA_H
+#define SERVER_LINGER_TEST_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bump allocator for per-connection state; nothing is freed individually,
+// the whole block goes back in one step when the connection is released
+typedef struct arena_t
+{
+  char* base;
+  size_t size;
+  size_t used;
+  size_t requested;
+  size_t failed;
+} arena_t;
+
+inline void arena_init(arena_t* arena, void* block, size_t size)
+{
+  arena->base = (char*)block;
+  arena->size = size;
+  arena->used = 0;
+  arena->requested = 0;
+  arena->failed = 0;
+}
+
+// the header and the block come from a single malloc
+inline arena_t* arena_create(size_t size)
+{
+  arena_t* arena = (arena_t*)malloc(sizeof(arena_t) + size);
+  if (arena != NULL)
+  {
+    arena_init(arena, arena + 1, size);
+  }
+  return arena;
+}
+
+inline void arena_destroy(arena_t* arena)
+{
+  free(arena);
+}
+
+// returns zeroed memory, or NULL if the arena is full
+inline void* arena_alloc(arena_t* arena, size_t size, size_t align = 16)
+{
+  uintptr_t start = (uintptr_t)(arena->base + arena->used);
+  uintptr_t aligned = (start + (align - 1)) & ~(uintptr_t)(align - 1);
+  size_t offset = (size_t)(aligned - (uintptr_t)arena->base);
+
+  if (offset + size > arena->size)
+  {
+    arena->failed++;
+    return NULL;
+  }
+
+  arena->used = offset + size;
+  arena->requested += size;
+
+  void* ptr = arena->base + offset;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+inline void arena_reset(arena_t* arena)
+{
+  arena->used = 0;
+  arena->requested = 0;
+  arena->failed = 0;
+}
+
+#endif
@@ -0,0 +1,644 @@
+#include "pch.h"
+#include "Commands.h"
+#include "Errors.h"
+#include "Fault.h"
+#include "Mpsc.h"
+#include "SocketPool.h"
+#include <iphlpapi.h>
+
+#pragma comment(lib, "iphlpapi.lib")
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+extern bool g_running;
+extern int g_churn_linger;
+
+extern LPFN_ACCEPTEX g_AcceptEx;
+extern LPFN_CONNECTEX g_ConnectEx;
+
+extern char* g_serverHost;
+extern char* g_serverPort;
+
+extern command_queue_t g_clientCommands;
+extern command_queue_t g_serverCommands;
+
+// connection churn: the server keeps CHURN_ACCEPTS AcceptEx calls posted and closes
+// every connection as soon as it is accepted; the client keeps CHURN_WORKERS connects
+// in flight and closes + reconnects from the completion routine, so the connection
+// rate is bounded only by the stack and the linger setting in g_churn_linger
+constexpr int CHURN_ACCEPTS = 64;
+constexpr int CHURN_WORKERS = 256;
+
+constexpr size_t CHURN_ADDR_LEN = sizeof(struct sockaddr_storage) + 16;
+
+// workers that could not get a port are parked here and retried by the client
+// thread, so ephemeral port exhaustion never blocks a completion thread
+constexpr DWORD CHURN_RETRY_MS = 1;
+
+// a connect that fails synchronously waits this long before its worker tries again
+constexpr DWORD CHURN_CONNECT_BACKOFF_MS = 50;
+
+// at exit each side waits this long for its accepts or connects to complete before
+// the contexts they point at are freed
+constexpr DWORD CHURN_DRAIN_MS = 5000;
+constexpr DWORD CHURN_POLL_MS = 10;
+
+// fault keys are (accept slot or worker, kind, attempt)
+enum class churn_kind_t
+{
+  CHURN_KIND_ACCEPT = 0,
+  CHURN_KIND_CONNECT = 1,
+  CHURN_KIND_CLOSE_ACCEPTED = 2,
+  CHURN_KIND_CLOSE_CONNECTED = 3
+};
+
+typedef struct churn_info_t
+{
+  OVERLAPPED ov;
+  unsigned long long fault_key;
+  mpsc_node_t retry_node;
+  unsigned stream;
+  unsigned long long attempts;
+  ULONGLONG retry_at;
+  SOCKET socket;
+  LARGE_INTEGER started;
+  char buf[CHURN_ADDR_LEN * 2];
+} churn_info_t;
+
+FAULT_KEYED(churn_info_t);
+
+static SOCKET churn_listen_socket = INVALID_SOCKET;
+static struct sockaddr_storage churn_server_addr;
+static int churn_server_addr_len = 0;
+static socket_pool_t churn_pool;
+static LARGE_INTEGER churn_qpc_frequency;
+static mpsc_queue_t churn_retry_queue;
+static volatile LONG churn_retry_pending = 0;
+
+// the threads own every context until their completions have drained; a worker or
+// accept slot that stops keeps its context here rather than freeing it
+static churn_info_t* churn_acceptors[CHURN_ACCEPTS];
+static churn_info_t* churn_workers[CHURN_WORKERS];
+static volatile LONG churn_accepts_outstanding = 0;
+static volatile LONG churn_connects_outstanding = 0;
+
+// completions close their socket under the shared lock and the client's teardown
+// cancels connects under the exclusive one, so it never cancels a closed handle
+static SRWLOCK churn_socket_lock = SRWLOCK_INIT;
+
+// soak statistics
+static volatile LONG64 churn_accepts = 0;
+static volatile LONG64 churn_accept_failures = 0;
+static volatile LONG64 churn_connects = 0;
+static volatile LONG64 churn_connect_failures = 0;
+static volatile LONG64 churn_refused = 0;
+static volatile LONG64 churn_bind_failures = 0;
+static volatile LONG churn_sockets_open = 0;
+static volatile LONG churn_sockets_peak = 0;
+static LONG churn_time_wait_peak = 0;
+static volatile LONG64 churn_connect_ticks = 0;
+
+static unsigned long long churn_key(churn_info_t* info, churn_kind_t kind)
+{
+  return fault_key(info->stream, (unsigned)kind, info->attempts);
+}
+
+static void churn_close(SOCKET s, unsigned long long key)
+{
+  if (g_churn_linger >= 0)
+  {
+    LINGER linger_opt;
+    linger_opt.l_onoff = 1;
+    linger_opt.l_linger = (u_short)g_churn_linger;
+    setsockopt(s, SOL_SOCKET, SO_LINGER, (const char*)&linger_opt, sizeof(linger_opt));
+  }
+  fault_close_socket(s, key);
+}
+
+// client sockets the workers have open; a port in TIME_WAIT is no longer one of
+// these, so port exhaustion is measured by churn_count_time_wait() instead
+static void churn_socket_opened()
+{
+  LONG held = InterlockedIncrement(&churn_sockets_open);
+  LONG peak = churn_sockets_peak;
+  while (held > peak)
+  {
+    LONG prev = InterlockedCompareExchange(&churn_sockets_peak, held, peak);
+    if (prev == peak)
+      break;
+    peak = prev;
+  }
+}
+
+static void churn_socket_closed(churn_info_t* info, unsigned long long key)
+{
+  AcquireSRWLockShared(&churn_socket_lock);
+  churn_close(info->socket, key);
+  info->socket = INVALID_SOCKET;
+  ReleaseSRWLockShared(&churn_socket_lock);
+  InterlockedDecrement(&churn_sockets_open);
+}
+
+static bool churn_start_accept(churn_info_t* info);
+static bool churn_start_connect(churn_info_t* info);
+
+static void __stdcall churn_server_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  churn_info_t* info = (churn_info_t*)overlapped;
+  InterlockedDecrement(&churn_accepts_outstanding);
+
+  if (errorCode == ERROR_SUCCESS)
+  {
+    InterlockedIncrement64(&churn_accepts);
+    setsockopt(info->socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char*)&churn_listen_socket, sizeof(SOCKET));
+  }
+  else if (errorCode != ERROR_OPERATION_ABORTED)
+  {
+    // aborts are the listener closing at shutdown; anything else is a failed accept
+    report_completion_error("Churn", "accept", info->socket, overlapped, errorCode);
+    InterlockedIncrement64(&churn_accept_failures);
+  }
+  churn_close(info->socket, churn_key(info, churn_kind_t::CHURN_KIND_CLOSE_ACCEPTED));
+  info->socket = INVALID_SOCKET;
+
+  // a slot that stops keeps its context in churn_acceptors for the server thread to free
+  if (g_running && errorCode != ERROR_OPERATION_ABORTED)
+  {
+    churn_start_accept(info);
+  }
+}
+
+static void __stdcall churn_client_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  churn_info_t* info = (churn_info_t*)overlapped;
+  InterlockedDecrement(&churn_connects_outstanding);
+
+  if (errorCode == ERROR_SUCCESS)
+  {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    InterlockedAdd64(&churn_connect_ticks, now.QuadPart - info->started.QuadPart);
+    InterlockedIncrement64(&churn_connects);
+  }
+  else
+  {
+    // a full accept queue shows up as a refused connect on Windows
+    count_error(classify_system_error(errorCode));
+    InterlockedIncrement64(&churn_connect_failures);
+    if (errorCode == ERROR_CONNECTION_REFUSED)
+      InterlockedIncrement64(&churn_refused);
+  }
+  churn_socket_closed(info, churn_key(info, churn_kind_t::CHURN_KIND_CLOSE_CONNECTED));
+
+  // a worker that stops keeps its context in churn_workers for the client thread to free
+  if (g_running)
+  {
+    churn_start_connect(info);
+  }
+}
+
+static bool churn_create_listen_socket()
+{
+  struct addrinfo hints = { 0 };
+  struct addrinfo* requested_address = NULL;
+
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_IP;
+
+  if (getaddrinfo(NULL, "0", &hints, &requested_address) != 0 || requested_address == NULL)
+  {
+    tsprintf("Churn: getaddrinfo() failed:\n");
+    printwindowserror(WSAGetLastError());
+    return false;
+  }
+
+  churn_listen_socket = WSASocket(requested_address->ai_family, requested_address->ai_socktype, requested_address->ai_protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+  if (churn_listen_socket == INVALID_SOCKET)
+  {
+    tsprintf("Churn: unable to create listen socket:\n");
+    printwindowserror(WSAGetLastError());
+    freeaddrinfo(requested_address);
+    return false;
+  }
+
+  if (!BIND_COMPLETION(churn_listen_socket, churn_server_completion_routine))
+  {
+    tsprintf("Churn: unable to bind io completion for listen socket:\n");
+    printwindowserror(GetLastError());
+    freeaddrinfo(requested_address);
+    return false;
+  }
+
+  if (bind(churn_listen_socket, requested_address->ai_addr, (int)requested_address->ai_addrlen) == SOCKET_ERROR
+    || listen(churn_listen_socket, SOMAXCONN) == SOCKET_ERROR)
+  {
+    tsprintf("Churn: unable to bind/listen:\n");
+    printwindowserror(WSAGetLastError());
+    freeaddrinfo(requested_address);
+    return false;
+  }
+
+  socklen_t actual_address_length = sizeof(struct sockaddr_storage);
+  struct sockaddr_storage actual_address;
+  if (getsockname(churn_listen_socket, (sockaddr*)&actual_address, &actual_address_length) != 0
+    || getnameinfo((sockaddr*)&actual_address, actual_address_length, g_serverHost, NI_MAXHOST, g_serverPort, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+  {
+    tsprintf("Churn: unable to get socket name:\n");
+    printwindowserror(WSAGetLastError());
+    freeaddrinfo(requested_address);
+    return false;
+  }
+
+  tsprintf("Churn: socket %d listening on %s:%s\n", churn_listen_socket, g_serverHost, g_serverPort);
+  freeaddrinfo(requested_address);
+  return true;
+}
+
+static bool churn_start_accept(churn_info_t* info)
+{
+  info->socket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+  if (info->socket == INVALID_SOCKET)
+  {
+    tsprintf("Churn: ERROR creating accept socket:\n");
+    printwindowserror(WSAGetLastError());
+    return false;
+  }
+
+  if (!BIND_COMPLETION(info->socket, churn_server_completion_routine))
+  {
+    tsprintf("Churn: ERROR binding IO completion callback:\n");
+    printwindowserror(GetLastError());
+    closesocket(info->socket);
+    return false;
+  }
+
+  memset(&info->ov, 0, sizeof(OVERLAPPED));
+  info->attempts++;
+  info->fault_key = churn_key(info, churn_kind_t::CHURN_KIND_ACCEPT);
+
+  DWORD bytes;
+  InterlockedIncrement(&churn_accepts_outstanding);
+  if (!g_AcceptEx(churn_listen_socket, info->socket, info->buf, 0, CHURN_ADDR_LEN, CHURN_ADDR_LEN, &bytes, &info->ov))
+  {
+    DWORD err = WSAGetLastError();
+    if (err != ERROR_IO_PENDING)
+    {
+      InterlockedDecrement(&churn_accepts_outstanding);
+      if (err != WSAENOTSOCK && err != WSAEINVAL)
+      {
+        report_error("Churn", "accept", err);
+      }
+      closesocket(info->socket);
+      info->socket = INVALID_SOCKET;
+      return false;
+    }
+  }
+
+  // a synchronous success still posts a completion packet
+  return true;
+}
+
+// hands the worker to the client thread, which retries it no sooner than delay_ms
+// from now; completion threads never wait out a failure themselves
+static void churn_park(churn_info_t* info, DWORD delay_ms)
+{
+  info->retry_at = GetTickCount64() + delay_ms;
+  InterlockedIncrement(&churn_retry_pending);
+  mpsc_push(&churn_retry_queue, &info->retry_node);
+}
+
+static bool churn_start_connect(churn_info_t* info)
+{
+  // pooled sockets are already bound to an ephemeral port and to the completion routine
+  info->socket = socket_pool_acquire(&churn_pool);
+  if (info->socket == INVALID_SOCKET)
+  {
+    DWORD error = WSAGetLastError();
+    if (classify_system_error(error) != error_kind_t::ERROR_KIND_RESOURCE)
+    {
+      report_error("Churn", "create client socket", error);
+      return false;
+    }
+
+    // ephemeral port exhaustion
+    InterlockedIncrement64(&churn_bind_failures);
+    churn_park(info, CHURN_RETRY_MS);
+    return true;
+  }
+  churn_socket_opened();
+
+  memset(&info->ov, 0, sizeof(OVERLAPPED));
+  info->attempts++;
+  info->fault_key = churn_key(info, churn_kind_t::CHURN_KIND_CONNECT);
+  QueryPerformanceCounter(&info->started);
+  InterlockedIncrement(&churn_connects_outstanding);
+  if (!g_ConnectEx(info->socket, (sockaddr*)&churn_server_addr, churn_server_addr_len, NULL, 0, NULL, &info->ov))
+  {
+    DWORD error = WSAGetLastError();
+    if (error != ERROR_IO_PENDING)
+    {
+      InterlockedDecrement(&churn_connects_outstanding);
+      report_error("Churn", "connect", error);
+      InterlockedIncrement64(&churn_connect_failures);
+      if (error == WSAECONNREFUSED)
+        InterlockedIncrement64(&churn_refused);
+      churn_socket_closed(info, churn_key(info, churn_kind_t::CHURN_KIND_CLOSE_CONNECTED));
+
+      // under port exhaustion these fail back to back; back off rather than spin
+      churn_park(info, CHURN_CONNECT_BACKOFF_MS);
+    }
+  }
+
+  return true;
+}
+
+// retries the workers parked since the last pass that are due; a worker that
+// fails again is parked again and waits for a later pass
+static void churn_retry_connects()
+{
+  LONG pending = churn_retry_pending;
+  while (pending-- > 0)
+  {
+    mpsc_node_t* node = mpsc_pop(&churn_retry_queue);
+    if (node == NULL)
+      break;
+
+    InterlockedDecrement(&churn_retry_pending);
+    churn_info_t* info = CONTAINING_RECORD(node, churn_info_t, retry_node);
+    if (GetTickCount64() < info->retry_at)
+    {
+      // not due yet; goes to the back of the queue for a later pass
+      InterlockedIncrement(&churn_retry_pending);
+      mpsc_push(&churn_retry_queue, &info->retry_node);
+    }
+    else if (g_running)
+    {
+      churn_start_connect(info);
+    }
+  }
+}
+
+// connections to or from the churn listener that are sitting in TIME_WAIT, i.e.
+// the ports the churn has used up and the stack has not yet given back; -1 if
+// the table cannot be read
+static LONG churn_count_time_wait()
+{
+  ULONG size = 0;
+  PMIB_TCPTABLE table = NULL;
+  DWORD result = ERROR_INSUFFICIENT_BUFFER;
+
+  // the table can grow between the size query and the read
+  for (int tries = 0; tries < 3 && result == ERROR_INSUFFICIENT_BUFFER; tries++)
+  {
+    free(table);
+    table = (PMIB_TCPTABLE)malloc(size > 0 ? size : sizeof(MIB_TCPTABLE));
+    if (table == NULL)
+    {
+      return -1;
+    }
+    if (size == 0)
+    {
+      size = sizeof(MIB_TCPTABLE);
+    }
+    result = GetTcpTable(table, &size, FALSE);
+  }
+
+  LONG count = -1;
+  if (result == NO_ERROR)
+  {
+    u_short port = htons((u_short)atoi(g_serverPort));
+    count = 0;
+    for (DWORD i = 0; i < table->dwNumEntries; i++)
+    {
+      const MIB_TCPROW* row = &table->table[i];
+      if (row->dwState == MIB_TCP_STATE_TIME_WAIT
+        && ((u_short)row->dwLocalPort == port || (u_short)row->dwRemotePort == port))
+      {
+        count++;
+      }
+    }
+  }
+
+  free(table);
+  if (count > churn_time_wait_peak)
+  {
+    churn_time_wait_peak = count;
+  }
+  return count;
+}
+
+static void churn_print_stats(const char* label, LONG64 accepts, LONG64 accept_failures, LONG64 connects, LONG64 failures, LONG64 refused, LONG64 bind_failures, LONG time_wait, DWORD ms)
+{
+  double secs = ms > 0 ? ms / 1000.0 : 1.0;
+  double connect_us = churn_connects > 0 && churn_qpc_frequency.QuadPart > 0
+    ? churn_connect_ticks * 1e6 / churn_qpc_frequency.QuadPart / churn_connects : 0.0;
+
+  tsprintf("Churn: %s %.0f conn/s, %.0f accept/s, %lld accept failures, %lld failed, %lld refused, %lld bind failures, TIME_WAIT %ld (peak %ld), client sockets open %ld (peak %ld), avg connect %.1f us\n",
+    label, connects / secs, accepts / secs, accept_failures, failures, refused, bind_failures, time_wait, churn_time_wait_peak,
+    churn_sockets_open, churn_sockets_peak, connect_us);
+}
+
+// waits until outstanding reaches zero or the drain deadline; cancel, if given,
+// runs on every poll so an operation posted by a completion racing the shutdown
+// is cancelled too
+static bool churn_wait_outstanding(volatile LONG* outstanding, void (*cancel)())
+{
+  ULONGLONG deadline = GetTickCount64() + CHURN_DRAIN_MS;
+  while (*outstanding > 0 && GetTickCount64() < deadline)
+  {
+    if (cancel != NULL)
+    {
+      cancel();
+    }
+    SleepEx(CHURN_POLL_MS, true);
+  }
+  return *outstanding == 0;
+}
+
+static void churn_cancel_connects()
+{
+  AcquireSRWLockExclusive(&churn_socket_lock);
+  for (int i = 0; i < CHURN_WORKERS; i++)
+  {
+    if (churn_workers[i] != NULL && churn_workers[i]->socket != INVALID_SOCKET)
+    {
+      CancelIoEx((HANDLE)churn_workers[i]->socket, NULL);
+    }
+  }
+  ReleaseSRWLockExclusive(&churn_socket_lock);
+}
+
+// frees the contexts once nothing can complete against them; if something is still
+// outstanding they are left allocated rather than freed under a completion
+static void churn_free_infos(churn_info_t** infos, int count, LONG outstanding, const char* what)
+{
+  if (outstanding > 0)
+  {
+    tsprintf("Churn: %d %s still outstanding after %d ms; leaving their contexts\n", outstanding, what, CHURN_DRAIN_MS);
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    free(infos[i]);
+    infos[i] = NULL;
+  }
+}
+
+DWORD WINAPI ChurnServerThread(LPVOID data)
+{
+  command_queue_attach(&g_serverCommands, command_wakeup_only);
+
+  if (!churn_create_listen_socket())
+  {
+    g_running = false;
+    tsprintf("Churn: ERROR; exiting\n");
+    command_queue_detach(&g_serverCommands);
+    return EXIT_FAILURE;
+  }
+
+  bool posted = true;
+  for (int i = 0; i < CHURN_ACCEPTS && posted; i++)
+  {
+    churn_info_t* info = (churn_info_t*)calloc(1, sizeof(churn_info_t));
+    churn_acceptors[i] = info;
+    if (info != NULL)
+    {
+      info->stream = i;
+    }
+    posted = info != NULL && churn_start_accept(info);
+  }
+
+  if (!posted)
+  {
+    g_running = false;
+    tsprintf("Churn: unable to post accepts; exiting\n");
+    closesocket(churn_listen_socket);
+    churn_listen_socket = INVALID_SOCKET;
+    churn_wait_outstanding(&churn_accepts_outstanding, NULL);
+    churn_free_infos(churn_acceptors, CHURN_ACCEPTS, churn_accepts_outstanding, "accepts");
+    command_queue_detach(&g_serverCommands);
+    return EXIT_FAILURE;
+  }
+
+  tsprintf("Churn: server running with %d accepts posted, linger %d...\n", CHURN_ACCEPTS, g_churn_linger);
+
+  DWORD start = GetTickCount();
+  DWORD last = start;
+  LONG64 last_accepts = 0, last_accept_failures = 0, last_connects = 0, last_failures = 0, last_refused = 0, last_bind_failures = 0;
+
+  while (g_running)
+  {
+    SleepEx(1000, true);
+
+    DWORD now = GetTickCount();
+    LONG64 accepts = churn_accepts, accept_failures = churn_accept_failures, connects = churn_connects, failures = churn_connect_failures;
+    LONG64 refused = churn_refused, bind_failures = churn_bind_failures;
+
+    churn_print_stats("last second:", accepts - last_accepts, accept_failures - last_accept_failures, connects - last_connects,
+      failures - last_failures, refused - last_refused, bind_failures - last_bind_failures, churn_count_time_wait(), now - last);
+
+    last = now;
+    last_accepts = accepts;
+    last_accept_failures = accept_failures;
+    last_connects = connects;
+    last_failures = failures;
+    last_refused = refused;
+    last_bind_failures = bind_failures;
+  }
+
+  churn_print_stats("total:", churn_accepts, churn_accept_failures, churn_connects, churn_connect_failures, churn_refused, churn_bind_failures,
+    churn_count_time_wait(), GetTickCount() - start);
+
+  // closing the listener aborts the outstanding accepts; their completions close
+  // the accept sockets and post nothing new
+  closesocket(churn_listen_socket);
+  churn_listen_socket = INVALID_SOCKET;
+  churn_wait_outstanding(&churn_accepts_outstanding, NULL);
+  churn_free_infos(churn_acceptors, CHURN_ACCEPTS, churn_accepts_outstanding, "accepts");
+
+  tsprintf("Churn: server exiting successfully\n");
+  command_queue_detach(&g_serverCommands);
+  return EXIT_SUCCESS;
+}
+
+DWORD WINAPI ChurnClientThread(LPVOID data)
+{
+  command_queue_attach(&g_clientCommands, command_wakeup_only);
+
+  tsprintf("Churn: client waiting for server...\n");
+
+  while (g_running && g_serverPort[0] == 0)
+  {
+    SleepEx(1, true);
+  }
+
+  if (!g_running)
+  {
+    command_queue_detach(&g_clientCommands);
+    return EXIT_SUCCESS;
+  }
+
+  if (!resolve_endpoint("127.0.0.1", g_serverPort, &churn_server_addr, &churn_server_addr_len))
+  {
+    tsprintf("Churn: unable to get address info for %s:%s:\n", g_serverHost, g_serverPort);
+    printwindowserror(WSAGetLastError());
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+
+  QueryPerformanceFrequency(&churn_qpc_frequency);
+  mpsc_init(&churn_retry_queue);
+  socket_pool_init(&churn_pool, "Churn", COMPLETION_ROUTINE(churn_client_completion_routine), SOCKET_POOL_MAX);
+
+  DWORD return_value = EXIT_SUCCESS;
+  for (int i = 0; i < CHURN_WORKERS; i++)
+  {
+    churn_info_t* info = (churn_info_t*)calloc(1, sizeof(churn_info_t));
+    churn_workers[i] = info;
+    if (info != NULL)
+    {
+      info->socket = INVALID_SOCKET;
+      info->stream = i;
+    }
+    if (info == NULL || !churn_start_connect(info))
+    {
+      tsprintf("Churn: unable to start client worker %d; exiting\n", i);
+      return_value = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  if (return_value == EXIT_SUCCESS)
+  {
+    tsprintf("Churn: client running with %d workers...\n", CHURN_WORKERS);
+  }
+
+  while (g_running && return_value == EXIT_SUCCESS)
+  {
+    SleepEx(CHURN_RETRY_MS, true);
+    churn_retry_connects();
+  }
+
+  // a worker failing to start leaves the rest running; stop them too
+  g_running = false;
+
+  // parked workers are not outstanding and stay in churn_workers; only the queue is emptied
+  while (mpsc_pop(&churn_retry_queue) != NULL)
+  {
+  }
+
+  // connects in flight are cancelled and their completions close the sockets
+  churn_wait_outstanding(&churn_connects_outstanding, churn_cancel_connects);
+  churn_free_infos(churn_workers, CHURN_WORKERS, churn_connects_outstanding, "connects");
+
+  socket_pool_destroy(&churn_pool);
+  print_socket_pool_stats(&churn_pool);
+
+  tsprintf("Churn: client exiting with %s\n", return_value == EXIT_SUCCESS ? "success" : "failure");
+  command_queue_detach(&g_clientCommands);
+  return return_value;
+}
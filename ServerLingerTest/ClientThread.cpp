@@ -1,65 +1,141 @@
 #include "pch.h"
+#include "Arena.h"
+#include "Commands.h"
+#include "Errors.h"
+#include "Fault.h"
+#include "Numa.h"
+#include "Poll.h"
+#include "Profile.h"
+#include "SocketPool.h"
+#include "Tls.h"
 #include <stdio.h>
 
 extern int tsprintf(const char* format, ...);
 extern void printwindowserror(int err);
 
 extern bool g_running;
+extern bool g_use_tls;
+extern bool g_test_echo;
 extern bool g_client_can_connect;
+extern DWORD g_drain_timeout_ms;
 
 extern LPFN_CONNECTEX g_ConnectEx;
 
+extern command_queue_t g_clientCommands;
+
 extern char* g_serverHost;
 extern char* g_serverPort;
 extern addrinfo* g_serverAddress;
 
 static bool connecting = false;
 static SOCKET client_socket = INVALID_SOCKET;
-static bool can_send = true;
+// set while a send is in flight and cleared only by its completion; the TLS
+// flush claims it first, so tls_send_buffer is never refilled under a send
+static volatile LONG sending = 0;
+static volatile LONG peer_closed = 0;
+static volatile LONG recv_failed = 0;
+
+static tls_session_t* client_tls = NULL;
+static socket_pool_t client_pool;
+
+constexpr size_t SEND_BUFFER_SIZE = 128;
+
+// echo test: one message in flight, timed from the send until the echo is all back
+constexpr size_t ECHO_MESSAGE_SIZE = 64;
+static bool echo_started = false;
+static LARGE_INTEGER echo_sent;
+static size_t echo_received = 0;
+
+// the connection's buffers come from one arena, released when the client exits
+static arena_t* client_arena = NULL;
+static char* send_buffer = NULL;
+static char* recv_buffer = NULL;
+static size_t recv_buffer_size = 0;
+
+// with NUMA placement on, the arena is committed on the client thread's node
+static numa_pool_t client_arena_pool;
+static USHORT client_node = NUMA_NODE_NONE;
+static char* tls_send_buffer = NULL;
 
 enum class iocp_info_kind_t
 {
   IOCP_KIND_CONNECT = 0,
-  IOCP_KIND_SEND = 1
+  IOCP_KIND_SEND = 1,
+  IOCP_KIND_RECV = 2
 };
 
+// fault key kind for closing the socket, after the iocp kinds
+constexpr unsigned CLIENT_FAULT_CLOSE = 3;
+
+// fault keys are (connection, kind, count of that kind on the connection)
+static ULONG client_stream = 0;
+static volatile LONG client_ops[CLIENT_FAULT_CLOSE];
+
 constexpr size_t IOCP_ACCEPT_ADDR_LEN = sizeof(struct sockaddr_storage) + 16;
 
 typedef struct iocp_info_t
 {
   OVERLAPPED ov;
+  unsigned long long fault_key;
   iocp_info_kind_t kind;
   SOCKET socket;
+  command_t* command;
+  tls_session_t* tls;
+  char* data;
+  ULONG len;
+  ULONG sent;
   char buf[IOCP_ACCEPT_ADDR_LEN * 2];
 } iocp_info_t;
 
+FAULT_KEYED(iocp_info_t);
+
+// infos allocated and not yet freed; the drain waits for this to reach zero
+static volatile LONG outstanding_iocp = 0;
+
+static unsigned long long client_fault_key(iocp_info_kind_t kind)
+{
+  return fault_key(client_stream, (unsigned)kind, (ULONG)InterlockedIncrement(&client_ops[(int)kind]));
+}
+
 static iocp_info_t* alloc_iocp(iocp_info_kind_t kind, SOCKET socket)
 {
+  PROFILE_SCOPE(PROFILE_ALLOC);
+
   iocp_info_t* info = (iocp_info_t*)malloc(sizeof(iocp_info_t));
   if (info != NULL)
   {
     memset(info, 0, sizeof(iocp_info_t));
     info->kind = kind;
     info->socket = socket;
+    info->fault_key = client_fault_key(kind);
+    InterlockedIncrement(&outstanding_iocp);
   }
   return info;
 }
 
-static bool complete_connect(SOCKET s);
-static bool start_send();
-
-static void print_wsa_error(SOCKET socket, LPOVERLAPPED overlapped)
+// the info's reference keeps its TLS session alive even if the client thread
+// closes the socket while the completion is still running
+static void free_iocp(iocp_info_t* info)
 {
-  DWORD numBytes;
-  DWORD flags;
-  WSAGetOverlappedResult(socket, overlapped, &numBytes, false, &flags);
-  DWORD error = GetLastError();
-  tsprintf("%x ", error);
-  printwindowserror(error);
+  tls_destroy(info->tls);
+  free(info);
+  InterlockedDecrement(&outstanding_iocp);
 }
 
+static bool complete_connect(SOCKET s);
+static bool start_send();
+static bool start_recv(SOCKET s, tls_session_t* session);
+static bool flush_tls(tls_session_t* session);
+static bool start_echo(tls_session_t* session);
+static void complete_echo(size_t len, tls_session_t* session);
+static bool post_send(iocp_info_t* info);
+
 static void __stdcall client_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
 {
+  PROFILE_SCOPE(PROFILE_HANDLER);
+
+  numa_note_completion(client_node);
+
   iocp_info_t* info = (iocp_info_t*)overlapped;
   switch (info->kind)
   {
@@ -72,87 +148,162 @@ static void __stdcall client_completion_routine(DWORD errorCode, DWORD numBytes,
     }
     else
     {
-      tsprintf("Client: error connecting socket %d:\n", info->socket);
-      print_wsa_error(info->socket, overlapped);
+      report_completion_error("Client", "connect", info->socket, overlapped, errorCode);
     }
     break;
   case iocp_info_kind_t::IOCP_KIND_SEND:
-    if (errorCode == ERROR_SUCCESS)
+    if (errorCode == ERROR_SUCCESS && info->sent + numBytes < info->len)
+    {
+      // a short send goes out again from the same info until the rest is sent
+      info->sent += numBytes;
+      memset(&info->ov, 0, sizeof(OVERLAPPED));
+      info->fault_key = client_fault_key(iocp_info_kind_t::IOCP_KIND_SEND);
+      if (post_send(info))
+      {
+        return;
+      }
+      InterlockedExchange(&sending, 0);
+    }
+    else if (errorCode == ERROR_SUCCESS)
+    {
+      if (!g_test_echo)
+      {
+        tsprintf("Client: ccr sent %d bytes\n", numBytes);
+      }
+      InterlockedExchange(&sending, 0);
+
+      if (info->tls != NULL)
+      {
+        flush_tls(info->tls);
+      }
+    }
+    else
+    {
+      InterlockedExchange(&sending, 0);
+      report_completion_error("Client", "send", info->socket, overlapped, errorCode);
+    }
+    break;
+  case iocp_info_kind_t::IOCP_KIND_RECV:
+    if (errorCode != ERROR_SUCCESS)
+    {
+      InterlockedExchange(&recv_failed, 1);
+      report_completion_error("Client", "recv", info->socket, overlapped, errorCode);
+    }
+    else if (numBytes == 0)
     {
-      tsprintf("Client: ccr sent %d bytes\n", numBytes);
-      can_send = true;
+      InterlockedExchange(&peer_closed, 1);
+    }
+    else if (info->tls == NULL)
+    {
+      // outside the echo test only posted while draining, and the data is discarded
+      start_recv(info->socket, NULL);
+      if (g_test_echo)
+      {
+        complete_echo(numBytes, NULL);
+      }
     }
     else
     {
-      tsprintf("Client: error sending:\n");
-      print_wsa_error(info->socket, overlapped);
+      int length = tls_recv(info->tls, recv_buffer, numBytes, TLS_BUFFER_SIZE);
+      if (length >= 0)
+      {
+        if (g_test_echo && length > 0)
+        {
+          complete_echo(length, info->tls);
+        }
+        flush_tls(info->tls);
+        start_recv(info->socket, info->tls);
+      }
+      else
+      {
+        // a bad record ends the session; no recv is posted after it
+        InterlockedExchange(&recv_failed, 1);
+        tsprintf("Client: TLS receive failed on socket %d\n", info->socket);
+      }
     }
     break;
   }
 
-  free(info);
+  PROFILE_SCOPE(PROFILE_FREE);
+  free(info->command);
+  free_iocp(info);
 }
 
-static bool start_connect()
+static size_t client_arena_size()
 {
-  struct addrinfo hints = { 0 };
-  hints.ai_flags = 0;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+  recv_buffer_size = g_use_tls ? TLS_BUFFER_SIZE : SEND_BUFFER_SIZE;
 
-  struct addrinfo* server_address = NULL;
+  size_t size = SEND_BUFFER_SIZE + recv_buffer_size + 64;
+  if (g_use_tls)
+  {
+    size += TLS_BUFFER_SIZE;
+  }
+  return size;
+}
 
-  if (getaddrinfo("127.0.0.1", g_serverPort, &hints, &server_address) != 0)
+static bool create_client_arena()
+{
+  client_arena = numa_arena_create(&client_arena_pool, client_arena_size());
+  if (client_arena == NULL)
   {
-    tsprintf("Client: unable to get address info for %s:%s:\n", g_serverHost, g_serverPort);
-    printwindowserror(WSAGetLastError());
     return false;
   }
 
-  SOCKET s = WSASocket(server_address->ai_family, server_address->ai_socktype, server_address->ai_protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
-  if (s == INVALID_SOCKET)
+  send_buffer = (char*)arena_alloc(client_arena, SEND_BUFFER_SIZE);
+  recv_buffer = (char*)arena_alloc(client_arena, recv_buffer_size);
+  if (g_use_tls)
   {
-    tsprintf("Client: unable to create client socket for %s:%s:\n", g_serverHost, g_serverPort);
-    printwindowserror(WSAGetLastError());
+    tls_send_buffer = (char*)arena_alloc(client_arena, TLS_BUFFER_SIZE);
+  }
+  return true;
+}
 
-    freeaddrinfo(server_address);
+static bool start_connect()
+{
+  if (client_arena == NULL && !create_client_arena())
+  {
+    tsprintf("Client: out of memory\n");
     return false;
   }
 
-  if (!BindIoCompletionCallback((HANDLE)s, client_completion_routine, 0))
-  {
-    tsprintf("Client: unable to bind io completion callback:\n");
-    printwindowserror(GetLastError());
+  struct sockaddr_storage server_addr;
+  int server_addr_len;
 
-    freeaddrinfo(server_address);
-    closesocket(s);
+  if (!resolve_endpoint("127.0.0.1", g_serverPort, &server_addr, &server_addr_len))
+  {
+    tsprintf("Client: unable to get address info for %s:%s:\n", g_serverHost, g_serverPort);
+    printwindowserror(WSAGetLastError());
     return false;
   }
 
-  struct sockaddr_storage addr = { 0 };
-  addr.ss_family = server_address->ai_family;
-  if (bind(s, (struct sockaddr*)&addr, (int)server_address->ai_addrlen) != 0)
+  // already created, bound and bound to client_completion_routine
+  SOCKET s = socket_pool_acquire(&client_pool);
+  if (s == INVALID_SOCKET)
   {
-    tsprintf("Client: unable to bind socket:\n");
+    tsprintf("Client: unable to create client socket for %s:%s:\n", g_serverHost, g_serverPort);
     printwindowserror(WSAGetLastError());
-
-    freeaddrinfo(server_address);
-    closesocket(s);
     return false;
   }
 
+  // a new connection starts new fault streams
+  client_stream++;
+  for (int i = 0; i < (int)CLIENT_FAULT_CLOSE; i++)
+  {
+    client_ops[i] = 0;
+  }
+
   iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_CONNECT, s);
   if (info == NULL)
   {
     tsprintf("Client: out of memory\n");
-    freeaddrinfo(server_address);
     closesocket(s);
     return false;
   }
 
+  PROFILE_SCOPE(PROFILE_POST);
+
   connecting = true;
-  if (g_ConnectEx(s, server_address->ai_addr, (int)server_address->ai_addrlen, NULL, 0, NULL, (LPOVERLAPPED)info))
+  if (g_ConnectEx(s, (struct sockaddr*)&server_addr, server_addr_len, NULL, 0, NULL, (LPOVERLAPPED)info))
   {
     tsprintf("Client: connected socket %d\n", s);
     complete_connect(s);
@@ -171,51 +322,97 @@ static bool start_connect()
       printwindowserror(error);
 
       connecting = false;
-      freeaddrinfo(server_address);
+      free_iocp(info);
       closesocket(s);
       return false;
     }
   }
 
-  freeaddrinfo(server_address);
   return true;
 }
 
 static bool complete_connect(SOCKET s)
 {
-  return setsockopt(s, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0) == 0;
+  if (setsockopt(s, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0) != 0)
+  {
+    return false;
+  }
+
+  if (g_use_tls)
+  {
+    // the ClientHello is already waiting in the TLS stage
+    client_tls = tls_create(false);
+    if (client_tls == NULL || !start_recv(s, client_tls))
+    {
+      return false;
+    }
+
+    client_socket = s;
+    return flush_tls(client_tls);
+  }
+
+  // the echo comes back on a recv that stays posted
+  if (g_test_echo)
+  {
+    return start_recv(s, NULL);
+  }
+
+  return true;
 }
 
-static char send_buffer[128];
 static int num_sent = 0;
 
-static bool start_send()
+// if command is given it owns data and is freed by the send completion; the
+// completion flushes session, if given, again
+static bool send_data(char* data, ULONG len, command_t* command = NULL, tls_session_t* session = NULL)
 {
-  int len = snprintf(send_buffer, 128, "MSG %d", num_sent++);
+  PROFILE_SCOPE(PROFILE_POST);
 
   iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_SEND, client_socket);
+  if (info == NULL)
+  {
+    tsprintf("Client: out of memory\n");
+    return false;
+  }
+  info->command = command;
+  info->tls = tls_retain(session);
+  info->data = data;
+  info->len = len;
+
+  if (!post_send(info))
+  {
+    free_iocp(info);
+    return false;
+  }
+  return true;
+}
 
+// posts whatever part of the info's data has not been sent yet
+static bool post_send(iocp_info_t* info)
+{
   WSABUF buf;
-  buf.buf = send_buffer;
-  buf.len = len;
+  buf.buf = info->data + info->sent;
+  buf.len = fault_post_length(info->fault_key, info->len - info->sent);
 
   DWORD bytesSent;
 
-  if (WSASend(client_socket, &buf, 1, &bytesSent, 0, (LPWSAOVERLAPPED)info, NULL) == 0)
+  if (WSASend(info->socket, &buf, 1, &bytesSent, 0, (LPWSAOVERLAPPED)info, NULL) == 0)
   {
-    tsprintf("Client: wsa sent %d bytes\n", bytesSent);
+    if (!g_test_echo)
+    {
+      tsprintf("Client: wsa sent %d bytes\n", bytesSent);
+    }
   }
   else
   {
     DWORD error = WSAGetLastError();
     if (error == WSA_IO_PENDING)
     {
-      can_send = false;
+      InterlockedExchange(&sending, 1);
     }
     else
     {
-      tsprintf("Client: error starting send:\n");
-      printwindowserror(error);
+      report_error("Client", "start send", error);
       return false;
     }
   }
@@ -223,10 +420,278 @@ static bool start_send()
   return true;
 }
 
+// sends whatever the TLS stage has ready; runs on the client thread and from
+// completions, so the send slot is claimed before the output is taken
+static bool flush_tls(tls_session_t* session)
+{
+  if (InterlockedCompareExchange(&sending, 1, 0) != 0)
+  {
+    return true;
+  }
+
+  size_t len = tls_take_output(session, tls_send_buffer, TLS_BUFFER_SIZE);
+  if (len == 0)
+  {
+    InterlockedExchange(&sending, 0);
+    return true;
+  }
+
+  if (!send_data(tls_send_buffer, (ULONG)len, NULL, session))
+  {
+    InterlockedExchange(&sending, 0);
+    return false;
+  }
+  return true;
+}
+
+static bool start_send()
+{
+  int len = snprintf(send_buffer, SEND_BUFFER_SIZE, "MSG %d", num_sent);
+
+  if (client_tls == NULL)
+  {
+    num_sent++;
+    return send_data(send_buffer, len);
+  }
+
+  // while a send is in flight, messages are coalesced into the next record; a
+  // full record keeps this message for the next tick, after the flush
+  if (tls_queue(client_tls, send_buffer, len))
+  {
+    num_sent++;
+  }
+  return flush_tls(client_tls);
+}
+
+static bool start_echo(tls_session_t* session)
+{
+  memset(send_buffer, 'e', ECHO_MESSAGE_SIZE);
+  echo_received = 0;
+  QueryPerformanceCounter(&echo_sent);
+
+  if (session == NULL)
+  {
+    return send_data(send_buffer, (ULONG)ECHO_MESSAGE_SIZE);
+  }
+
+  // only one message is ever in flight, so a full record means the session is stuck
+  if (!tls_queue(session, send_buffer, ECHO_MESSAGE_SIZE))
+  {
+    tsprintf("Client: TLS stage refused the echo message\n");
+    return false;
+  }
+  return flush_tls(session);
+}
+
+static void complete_echo(size_t len, tls_session_t* session)
+{
+  echo_received += len;
+  if (echo_received < ECHO_MESSAGE_SIZE)
+  {
+    return;
+  }
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  latency_record(now.QuadPart - echo_sent.QuadPart);
+
+  if (g_running)
+  {
+    start_echo(session);
+  }
+}
+
+// session, if given, is the TLS session the completion decrypts with
+static bool start_recv(SOCKET s, tls_session_t* session)
+{
+  PROFILE_SCOPE(PROFILE_POST);
+
+  iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_RECV, s);
+  if (info == NULL)
+  {
+    tsprintf("Client: out of memory\n");
+    return false;
+  }
+  info->tls = tls_retain(session);
+
+  WSABUF buf;
+  buf.buf = recv_buffer;
+  buf.len = fault_post_length(info->fault_key, (ULONG)recv_buffer_size);
+  DWORD bytesReceived;
+  DWORD flags = 0;
+
+  if (WSARecv(s, &buf, 1, &bytesReceived, &flags, (LPWSAOVERLAPPED)info, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    if (error != WSA_IO_PENDING)
+    {
+      report_error("Client", "start recv", error);
+      free_iocp(info);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void close_client_socket()
+{
+  fault_close_socket(client_socket, fault_key(client_stream, CLIENT_FAULT_CLOSE, 0));
+  client_socket = INVALID_SOCKET;
+  connecting = false;
+  sending = 0;
+  peer_closed = 0;
+  recv_failed = 0;
+  echo_started = false;
+
+  // drops the client thread's reference; a completion still running holds its own
+  if (client_tls != NULL)
+  {
+    tls_session_t* session = client_tls;
+    client_tls = NULL;
+    tls_destroy(session);
+  }
+}
+
+constexpr DWORD DRAIN_POLL_MS = 10;
+constexpr DWORD DRAIN_CANCEL_WAIT_MS = 1000;
+
+// lets the send in flight (and anything the TLS stage has queued) finish, then
+// half-closes and waits for the server's FIN; past the deadline the socket is reset
+static void drain_client_socket()
+{
+  ULONGLONG deadline = GetTickCount64() + g_drain_timeout_ms;
+
+  // a connect still in flight gets the same deadline
+  while (connecting && client_socket == INVALID_SOCKET && outstanding_iocp > 0 && GetTickCount64() < deadline)
+  {
+    SleepEx(DRAIN_POLL_MS, true);
+  }
+
+  if (client_socket != INVALID_SOCKET)
+  {
+    while (GetTickCount64() < deadline && !recv_failed)
+    {
+      if (client_tls != NULL)
+      {
+        flush_tls(client_tls);
+      }
+      if (sending == 0)
+      {
+        break;
+      }
+      SleepEx(DRAIN_POLL_MS, true);
+    }
+
+    // a TLS connection always has a recv posted; otherwise one is needed to see the FIN
+    bool graceful = sending == 0 && !recv_failed && shutdown(client_socket, SD_SEND) == 0
+      && (client_tls != NULL || start_recv(client_socket, NULL));
+
+    while (graceful && !peer_closed && !recv_failed && GetTickCount64() < deadline)
+    {
+      SleepEx(DRAIN_POLL_MS, true);
+    }
+
+    if (graceful && peer_closed)
+    {
+      tsprintf("Client: socket %d drained\n", client_socket);
+    }
+    else
+    {
+      tsprintf("Client: resetting socket %d at the drain deadline\n", client_socket);
+
+      LINGER linger_opt;
+      linger_opt.l_onoff = 1;
+      linger_opt.l_linger = 0;
+      setsockopt(client_socket, SOL_SOCKET, SO_LINGER, (const char*)&linger_opt, sizeof(linger_opt));
+    }
+
+    close_client_socket();
+  }
+
+  // cancelled operations free their infos as they complete
+  deadline = max(deadline, GetTickCount64() + DRAIN_CANCEL_WAIT_MS);
+  while (outstanding_iocp > 0 && GetTickCount64() < deadline)
+  {
+    SleepEx(DRAIN_POLL_MS, true);
+  }
+
+  if (outstanding_iocp > 0)
+  {
+    tsprintf("Client: %d operations still outstanding after the drain\n", outstanding_iocp);
+  }
+}
+
+// runs on the client thread, woken out of SleepEx by command_post()
+static bool client_command(command_queue_t* queue, command_t* command)
+{
+  bool addressed = client_socket != INVALID_SOCKET
+    && (command->socket == INVALID_SOCKET || command->socket == client_socket);
+
+  switch (command->kind)
+  {
+  case command_kind_t::COMMAND_SEND:
+    if (!addressed)
+    {
+      command_reject(queue, command, "not connected");
+      break;
+    }
+
+    if (client_tls != NULL)
+    {
+      if (command->len <= TLS_RECORD_MAX && tls_queue(client_tls, command->data, command->len))
+      {
+        flush_tls(client_tls);
+      }
+      else
+      {
+        command_reject(queue, command, "TLS stage full");
+      }
+      break;
+    }
+
+    // sent straight from the command, which the send completion frees
+    if (send_data(command->data, (ULONG)command->len, command))
+    {
+      return false;
+    }
+    command_reject(queue, command, "send failed");
+    break;
+
+  case command_kind_t::COMMAND_CLOSE:
+    if (addressed)
+    {
+      tsprintf("Client: closing socket %d by request\n", client_socket);
+      close_client_socket();
+    }
+    else
+    {
+      command_reject(queue, command, "not connected");
+    }
+    break;
+
+  default:
+    // COMMAND_SHUTDOWN only needs the wakeup; the loop re-checks g_running
+    break;
+  }
+
+  return true;
+}
+
 DWORD WINAPI ClientThread(LPVOID data)
 {
   tsprintf("Client running...\n");
 
+  // the load generator goes on the last node, away from the server where there is a choice
+  client_node = numa_bind_thread(numa_node_count() - 1);
+  if (client_node != NUMA_NODE_NONE)
+  {
+    numa_pool_init(&client_arena_pool, "Client", client_node, sizeof(arena_t) + client_arena_size(), 1);
+  }
+
+  // one connection at a time; keep a spare so reconnects skip socket setup
+  socket_pool_init(&client_pool, "Client", COMPLETION_ROUTINE(client_completion_routine), 2);
+  command_queue_attach(&g_clientCommands, client_command);
+
   while (g_running)
   {
     SleepEx(1000, true);
@@ -249,7 +714,17 @@ DWORD WINAPI ClientThread(LPVOID data)
       len = sizeof(secs);
       getsockopt(client_socket, SOL_SOCKET, SO_CONNECT_TIME, (char*)&secs, &len);
 
-      if (can_send && !start_send())
+      bool ready = client_tls == NULL ? sending == 0 : tls_handshake_done(client_tls);
+      if (g_test_echo)
+      {
+        // after the first message, each echo sends the next from its completion
+        if (ready && !echo_started)
+        {
+          echo_started = true;
+          start_echo(client_tls);
+        }
+      }
+      else if (ready && !start_send())
       {
         tsprintf("Client: start send failed for socket %d; exiting\n", client_socket);
         return EXIT_FAILURE;
@@ -257,6 +732,32 @@ DWORD WINAPI ClientThread(LPVOID data)
     }
   }
 
+  command_queue_detach(&g_clientCommands);
+  drain_client_socket();
+
+  if (client_tls != NULL)
+  {
+    tls_session_t* session = client_tls;
+    client_tls = NULL;
+    tls_destroy(session);
+  }
+
+  if (client_arena != NULL)
+  {
+    tsprintf("Client: %d connection arena bytes used\n", (int)client_arena->used);
+    numa_arena_destroy(&client_arena_pool, client_arena);
+    client_arena = NULL;
+  }
+
+  print_numa_pool_stats(&client_arena_pool);
+  if (outstanding_iocp == 0)
+  {
+    numa_pool_destroy(&client_arena_pool);
+  }
+
+  socket_pool_destroy(&client_pool);
+  print_socket_pool_stats(&client_pool);
+
   tsprintf("Client: exiting with success\n");
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,159 @@
+#include "pch.h"
+#include "Commands.h"
+
+extern int tsprintf(const char* format, ...);
+
+static const char* command_kind_names[] = { "shutdown", "close", "send" };
+
+static void command_queue_drain(command_queue_t* queue)
+{
+  mpsc_node_t* node;
+  while ((node = mpsc_pop(&queue->queue)) != NULL)
+  {
+    command_t* command = (command_t*)node;
+    bool done = true;
+    if (queue->handler != NULL)
+    {
+      done = queue->handler(queue, command);
+      InterlockedIncrement64(&queue->executed);
+    }
+    else
+    {
+      InterlockedIncrement64(&queue->dropped);
+    }
+    if (done)
+    {
+      free(command);
+    }
+  }
+}
+
+static void CALLBACK command_queue_apc(ULONG_PTR data)
+{
+  command_queue_t* queue = (command_queue_t*)data;
+
+  // re-arm before draining so a post racing with the drain queues another wakeup
+  InterlockedExchange(&queue->wakeup_pending, 0);
+  command_queue_drain(queue);
+}
+
+void command_queue_init(command_queue_t* queue, const char* name)
+{
+  queue->name = name;
+  mpsc_init(&queue->queue);
+  InitializeSRWLock(&queue->thread_lock);
+  queue->thread = NULL;
+  queue->wakeup_pending = 0;
+  queue->handler = NULL;
+  queue->posted = 0;
+  queue->executed = 0;
+  queue->rejected = 0;
+  queue->dropped = 0;
+}
+
+void command_queue_attach(command_queue_t* queue, command_handler_t handler)
+{
+  HANDLE thread = NULL;
+  DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread, 0, FALSE, DUPLICATE_SAME_ACCESS);
+
+  queue->handler = handler;
+
+  AcquireSRWLockExclusive(&queue->thread_lock);
+  queue->thread = thread;
+  ReleaseSRWLockExclusive(&queue->thread_lock);
+
+  command_queue_drain(queue);
+}
+
+void command_queue_detach(command_queue_t* queue)
+{
+  // a wake holds the lock shared for as long as it uses the handle
+  AcquireSRWLockExclusive(&queue->thread_lock);
+  HANDLE thread = queue->thread;
+  queue->thread = NULL;
+  ReleaseSRWLockExclusive(&queue->thread_lock);
+
+  // anything left is dropped unexecuted
+  queue->handler = NULL;
+  command_queue_drain(queue);
+
+  if (thread != NULL)
+  {
+    CloseHandle(thread);
+  }
+}
+
+bool command_wakeup_only(command_queue_t* queue, command_t* command)
+{
+  if (command->kind != command_kind_t::COMMAND_SHUTDOWN)
+  {
+    command_reject(queue, command, "not supported in this mode");
+  }
+  return true;
+}
+
+void command_reject(command_queue_t* queue, command_t* command, const char* why)
+{
+  InterlockedIncrement64(&queue->rejected);
+  tsprintf("Commands: %s rejected %s for socket %d (%d bytes): %s\n", queue->name,
+    command_kind_names[(int)command->kind], command->socket, (int)command->len, why);
+}
+
+command_t* command_create(command_kind_t kind, SOCKET socket, const char* data, size_t len)
+{
+  command_t* command = (command_t*)malloc(sizeof(command_t) + len);
+  if (command != NULL)
+  {
+    command->kind = kind;
+    command->socket = socket;
+    command->len = len;
+    if (len > 0)
+    {
+      memcpy(command->data, data, len);
+    }
+    command->data[len] = 0;
+  }
+  return command;
+}
+
+void command_queue_wake(command_queue_t* queue)
+{
+  // one APC covers every command pushed until the owner starts draining
+  AcquireSRWLockShared(&queue->thread_lock);
+  if (queue->thread != NULL && InterlockedExchange(&queue->wakeup_pending, 1) == 0)
+  {
+    if (!QueueUserAPC(command_queue_apc, queue->thread, (ULONG_PTR)queue))
+    {
+      InterlockedExchange(&queue->wakeup_pending, 0);
+    }
+  }
+  ReleaseSRWLockShared(&queue->thread_lock);
+}
+
+bool command_post(command_queue_t* queue, command_t* command)
+{
+  if (command == NULL)
+  {
+    return false;
+  }
+
+  mpsc_push(&queue->queue, &command->node);
+  InterlockedIncrement64(&queue->posted);
+
+  command_queue_wake(queue);
+  return true;
+}
+
+bool command_post(command_queue_t* queue, command_kind_t kind, SOCKET socket, const char* data, size_t len)
+{
+  return command_post(queue, command_create(kind, socket, data, len));
+}
+
+void print_command_stats(command_queue_t* queue)
+{
+  if (queue->posted > 0)
+  {
+    tsprintf("Commands: %s: %lld posted, %lld executed, %lld rejected, %lld dropped\n",
+      queue->name, queue->posted, queue->executed, queue->rejected, queue->dropped);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef SERVER_LINGER_TEST_COMMANDS_H
+#define SERVER_LINGER_TEST_COMMANDS_H
+
+#include "Mpsc.h"
+
+// work posted from any thread onto the thread that owns a set of sockets; the
+// owner is woken with an APC, which its alertable SleepEx picks up immediately
+enum class command_kind_t
+{
+  COMMAND_SHUTDOWN = 0,
+  COMMAND_CLOSE = 1,
+  COMMAND_SEND = 2
+};
+
+typedef struct command_t
+{
+  mpsc_node_t node;
+  command_kind_t kind;
+  SOCKET socket;
+  size_t len;
+  char data[1];
+} command_t;
+
+typedef struct command_queue_t command_queue_t;
+
+// returns false if it keeps the command, which it must then free() itself
+typedef bool (*command_handler_t)(command_queue_t* queue, command_t* command);
+
+typedef struct command_queue_t
+{
+  const char* name;
+  mpsc_queue_t queue;
+  SRWLOCK thread_lock;
+  HANDLE thread;
+  volatile LONG wakeup_pending;
+  command_handler_t handler;
+  volatile LONG64 posted;
+  volatile LONG64 executed;
+  volatile LONG64 rejected;
+  volatile LONG64 dropped;
+} command_queue_t;
+
+extern void command_queue_init(command_queue_t* queue, const char* name);
+
+// called on the owning thread; commands posted before this run now
+extern void command_queue_attach(command_queue_t* queue, command_handler_t handler);
+extern void command_queue_detach(command_queue_t* queue);
+
+// for owners that only need the wakeup: COMMAND_SHUTDOWN is accepted and
+// everything else is rejected
+extern bool command_wakeup_only(command_queue_t* queue, command_t* command);
+
+// called by a handler for a command it cannot carry out; counted and logged
+extern void command_reject(command_queue_t* queue, command_t* command, const char* why);
+
+// wakes the owner without a command, e.g. so it can look at state a completion changed
+extern void command_queue_wake(command_queue_t* queue);
+
+// socket INVALID_SOCKET addresses the owner's current connection
+extern command_t* command_create(command_kind_t kind, SOCKET socket, const char* data, size_t len);
+extern bool command_post(command_queue_t* queue, command_t* command);
+extern bool command_post(command_queue_t* queue, command_kind_t kind, SOCKET socket = INVALID_SOCKET, const char* data = NULL, size_t len = 0);
+
+extern void print_command_stats(command_queue_t* queue);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef SERVER_LINGER_TEST_CONNECTION_H
+#define SERVER_LINGER_TEST_CONNECTION_H
+
+#include "Arena.h"
+#include "Fault.h"
+#include "Tls.h"
+
+// the server's per-connection layout, shared with the benchmarks so they size and
+// carve arenas exactly as ServerThread does
+constexpr size_t READ_BUFFER_SIZE = 1024;
+
+enum class iocp_info_kind_t
+{
+  IOCP_KIND_ACCEPT = 0,
+  IOCP_KIND_RECV = 1,
+  IOCP_KIND_SEND = 2,
+  IOCP_KIND_DISCONNECT = 3
+};
+
+// fault key kind for closing a connection's socket, after the iocp kinds
+constexpr unsigned SERVER_FAULT_CLOSE = 4;
+
+constexpr size_t IOCP_ACCEPT_ADDR_LEN = sizeof(struct sockaddr_storage) + 16;
+
+typedef struct command_t command_t;
+typedef struct connection_t connection_t;
+
+typedef struct iocp_info_t
+{
+  OVERLAPPED ov;
+  unsigned long long fault_key;
+  iocp_info_kind_t kind;
+  SOCKET socket;
+  connection_t* connection;
+  char buf[IOCP_ACCEPT_ADDR_LEN * 2];
+} iocp_info_t;
+
+FAULT_KEYED(iocp_info_t);
+
+// all per-connection state lives in the connection's arena; every posted
+// operation holds a reference and the arena goes away with the last one
+typedef struct connection_t
+{
+  arena_t* arena;
+  volatile LONG refs;
+  SOCKET socket;
+  iocp_info_t* recv_info;
+  iocp_info_t* send_info;
+  char* read_buffer;
+  char* print_buffer;
+  char* send_buffer;
+  command_t* send_command;
+  tls_session_t* tls;
+  volatile LONG sending;
+  size_t send_offset;
+  size_t send_length;
+  int echo_backlog;
+  volatile LONG peer_closed;
+  volatile LONG recv_failed;
+  USHORT home_node;
+  UINT32 trace_id;
+  UINT32 fault_stream;
+  ULONG fault_ops[SERVER_FAULT_CLOSE];
+} connection_t;
+
+// the connection, both buffers, the accept/recv/send/disconnect infos and
+// alignment slack; send_stage adds the buffer TLS and the echo test send from
+inline size_t connection_arena_size(bool send_stage)
+{
+  size_t size = sizeof(connection_t) + 4 * sizeof(iocp_info_t) + 2 * READ_BUFFER_SIZE + 128;
+  if (send_stage)
+  {
+    size += TLS_BUFFER_SIZE;
+  }
+  return size;
+}
+
+#endif
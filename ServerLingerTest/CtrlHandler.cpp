@@ -1,9 +1,21 @@
 #include "pch.h"
+#include "Commands.h"
 
 extern bool g_running;
+extern bool g_ctrl_break_closes;
+
+extern command_queue_t g_serverCommands;
+extern command_queue_t g_clientCommands;
 
 BOOL WINAPI CtrlHandler(DWORD dwEvent)
 {
+  if (dwEvent == CTRL_BREAK_EVENT && g_ctrl_break_closes)
+  {
+    // closes the server's current connection; runs on the server thread
+    command_post(&g_serverCommands, command_kind_t::COMMAND_CLOSE);
+    return TRUE;
+  }
+
   switch (dwEvent)
   {
   case CTRL_BREAK_EVENT:
@@ -12,6 +24,8 @@ BOOL WINAPI CtrlHandler(DWORD dwEvent)
   case CTRL_SHUTDOWN_EVENT:
   case CTRL_CLOSE_EVENT:
     g_running = false;
+    command_post(&g_serverCommands, command_kind_t::COMMAND_SHUTDOWN);
+    command_post(&g_clientCommands, command_kind_t::COMMAND_SHUTDOWN);
     return TRUE;
   default:
     return FALSE;
@@ -0,0 +1,163 @@
+#include "pch.h"
+#include "Errors.h"
+#include <errno.h>
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+static volatile LONG error_counts[(int)error_kind_t::ERROR_KIND_COUNT];
+
+static const char* error_kind_names[(int)error_kind_t::ERROR_KIND_COUNT] =
+{
+  "none", "cancelled", "reset", "timed out", "refused", "resource", "unexpected"
+};
+
+error_kind_t classify_errno(int err)
+{
+  switch (err)
+  {
+  case 0:
+    return error_kind_t::ERROR_KIND_NONE;
+
+  case ECANCELED:
+  case EINTR:
+    return error_kind_t::ERROR_KIND_CANCELLED;
+
+  case ECONNRESET:
+  case ECONNABORTED:
+  case ENETRESET:
+  case ENOTCONN:
+  case EPIPE:
+#ifdef ESHUTDOWN
+  case ESHUTDOWN:
+#endif
+    return error_kind_t::ERROR_KIND_RESET;
+
+  case ETIMEDOUT:
+    return error_kind_t::ERROR_KIND_TIMED_OUT;
+
+  case ECONNREFUSED:
+  case ENETUNREACH:
+  case EHOSTUNREACH:
+    return error_kind_t::ERROR_KIND_REFUSED;
+
+  case ENOMEM:
+  case ENOBUFS:
+  case EMFILE:
+  case ENFILE:
+  case EADDRINUSE:
+  case EADDRNOTAVAIL:
+    return error_kind_t::ERROR_KIND_RESOURCE;
+
+  default:
+    return error_kind_t::ERROR_KIND_UNEXPECTED;
+  }
+}
+
+// completion routines see Win32 codes translated from the NTSTATUS, while
+// synchronous Winsock calls return WSA codes, so both are mapped here
+error_kind_t classify_system_error(DWORD err)
+{
+  switch (err)
+  {
+  case ERROR_SUCCESS:
+    return error_kind_t::ERROR_KIND_NONE;
+
+  case ERROR_OPERATION_ABORTED:
+  case ERROR_CANCELLED:
+  case WSAECANCELLED:
+  case WSAEINTR:
+    return error_kind_t::ERROR_KIND_CANCELLED;
+
+  case ERROR_NETNAME_DELETED:
+  case ERROR_CONNECTION_ABORTED:
+  case ERROR_CONNECTION_INVALID:
+  case ERROR_GRACEFUL_DISCONNECT:
+  case ERROR_BROKEN_PIPE:
+  case WSAECONNRESET:
+  case WSAECONNABORTED:
+  case WSAENETRESET:
+  case WSAENOTCONN:
+  case WSAESHUTDOWN:
+  case WSAEDISCON:
+    return error_kind_t::ERROR_KIND_RESET;
+
+  case ERROR_SEM_TIMEOUT:
+  case ERROR_TIMEOUT:
+  case WSAETIMEDOUT:
+    return error_kind_t::ERROR_KIND_TIMED_OUT;
+
+  case ERROR_CONNECTION_REFUSED:
+  case ERROR_NETWORK_UNREACHABLE:
+  case ERROR_HOST_UNREACHABLE:
+  case ERROR_PORT_UNREACHABLE:
+  case WSAECONNREFUSED:
+  case WSAENETUNREACH:
+  case WSAEHOSTUNREACH:
+    return error_kind_t::ERROR_KIND_REFUSED;
+
+  case ERROR_NOT_ENOUGH_MEMORY:
+  case ERROR_OUTOFMEMORY:
+  case ERROR_NO_SYSTEM_RESOURCES:
+  case ERROR_TOO_MANY_OPEN_FILES:
+  case WSAENOBUFS:
+  case WSAEMFILE:
+  case WSAEADDRINUSE:
+  case WSAEADDRNOTAVAIL:
+    return error_kind_t::ERROR_KIND_RESOURCE;
+
+  default:
+    return error_kind_t::ERROR_KIND_UNEXPECTED;
+  }
+}
+
+void count_error(error_kind_t kind)
+{
+  InterlockedIncrement(&error_counts[(int)kind]);
+}
+
+long get_error_count(error_kind_t kind)
+{
+  return error_counts[(int)kind];
+}
+
+bool report_error(const char* who, const char* op, DWORD err)
+{
+  error_kind_t kind = classify_system_error(err);
+  count_error(kind);
+
+  if (kind != error_kind_t::ERROR_KIND_UNEXPECTED)
+    return false;
+
+  tsprintf("%s: %s failed with error %x:\n", who, op, err);
+  printwindowserror(err);
+  return true;
+}
+
+bool report_completion_error(const char* who, const char* op, SOCKET socket, LPOVERLAPPED overlapped, DWORD errorCode)
+{
+  error_kind_t kind = classify_system_error(errorCode);
+  count_error(kind);
+
+  if (kind != error_kind_t::ERROR_KIND_UNEXPECTED)
+    return false;
+
+  // only now pay for the Winsock error code and the message text
+  DWORD numBytes;
+  DWORD flags;
+  WSAGetOverlappedResult(socket, overlapped, &numBytes, false, &flags);
+  DWORD error = WSAGetLastError();
+
+  tsprintf("%s: %s failed for %d with error %x (%x):\n", who, op, socket, errorCode, error);
+  printwindowserror(error);
+  return true;
+}
+
+void print_error_counts()
+{
+  tsprintf("Errors:");
+  for (int i = (int)error_kind_t::ERROR_KIND_CANCELLED; i < (int)error_kind_t::ERROR_KIND_COUNT; i++)
+  {
+    tsprintf(" %ld %s%s", error_counts[i], error_kind_names[i], i + 1 < (int)error_kind_t::ERROR_KIND_COUNT ? "," : "\n");
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef SERVER_LINGER_TEST_ERRORS_H
+#define SERVER_LINGER_TEST_ERRORS_H
+
+// coarse error categories; everything the engine expects to see during normal
+// connection teardown is counted, only ERROR_KIND_UNEXPECTED is formatted
+enum class error_kind_t
+{
+  ERROR_KIND_NONE = 0,
+  ERROR_KIND_CANCELLED = 1,
+  ERROR_KIND_RESET = 2,
+  ERROR_KIND_TIMED_OUT = 3,
+  ERROR_KIND_REFUSED = 4,
+  ERROR_KIND_RESOURCE = 5,
+  ERROR_KIND_UNEXPECTED = 6,
+  ERROR_KIND_COUNT = 7
+};
+
+extern error_kind_t classify_errno(int err);
+extern void count_error(error_kind_t kind);
+extern long get_error_count(error_kind_t kind);
+extern void print_error_counts();
+
+#ifdef _WIN32
+extern error_kind_t classify_system_error(DWORD err);
+extern bool report_error(const char* who, const char* op, DWORD err);
+extern bool report_completion_error(const char* who, const char* op, SOCKET socket, LPOVERLAPPED overlapped, DWORD errorCode);
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+#include "pch.h"
+#include "Fault.h"
+
+extern int tsprintf(const char* format, ...);
+
+// delayed and reordered completions are held on a logical clock that ticks once
+// per completion delivered, so a delay is a number of completions rather than
+// wall-clock time; when the table is full a completion is delivered on time
+constexpr int FAULT_HELD_MAX = 64;
+
+// only for liveness: if nothing has completed for this long, the clock is moved
+// to the earliest held completion as if the completions in between had happened
+constexpr DWORD FAULT_STALL_MS = 5;
+
+// salts keep the decisions made for one key independent of each other
+constexpr unsigned long long FAULT_SALT_POST = 0x5bd1e9955bd1e995ULL;
+constexpr unsigned long long FAULT_SALT_CLOSE = 0xc2b2ae3d27d4eb4fULL;
+
+typedef struct fault_completion_t
+{
+  LPOVERLAPPED_COMPLETION_ROUTINE routine;
+  DWORD errorCode;
+  DWORD numBytes;
+  LPOVERLAPPED overlapped;
+  LONG64 due;
+  LONG64 order;
+} fault_completion_t;
+
+static SRWLOCK fault_lock = SRWLOCK_INIT;
+static fault_completion_t fault_held[FAULT_HELD_MAX];
+static int fault_held_count = 0;
+static LONG64 fault_clock = 0;
+static LONG64 fault_order = 0;
+static bool fault_watching = false;
+
+static volatile LONG fault_delays = 0;
+static volatile LONG fault_reorders = 0;
+static volatile LONG fault_failures = 0;
+static volatile LONG fault_partials = 0;
+static volatile LONG fault_resets = 0;
+static volatile LONG fault_fins = 0;
+static volatile LONG fault_stalls = 0;
+
+typedef struct fault_rng_t
+{
+  unsigned long long state;
+} fault_rng_t;
+
+static unsigned long long fault_next(fault_rng_t* rng)
+{
+  // splitmix64
+  unsigned long long z = (rng->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static bool fault_roll(fault_rng_t* rng, unsigned permille)
+{
+  return permille > 0 && fault_next(rng) % 1000 < permille;
+}
+
+static void fault_seed(fault_rng_t* rng, unsigned long long key)
+{
+  rng->state = g_fault.seed ^ key;
+}
+
+// moves the held completions that are due at the current clock into ready, in
+// due order; called with fault_lock held
+static int fault_take_due(fault_completion_t* ready)
+{
+  int count = 0;
+  while (fault_held_count > 0)
+  {
+    int next = 0;
+    for (int i = 1; i < fault_held_count; i++)
+    {
+      if (fault_held[i].due < fault_held[next].due
+        || (fault_held[i].due == fault_held[next].due && fault_held[i].order < fault_held[next].order))
+      {
+        next = i;
+      }
+    }
+
+    if (fault_held[next].due > fault_clock)
+    {
+      break;
+    }
+
+    ready[count++] = fault_held[next];
+    fault_held[next] = fault_held[--fault_held_count];
+  }
+  return count;
+}
+
+static void fault_release(fault_completion_t* ready, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    ready[i].routine(ready[i].errorCode, ready[i].numBytes, ready[i].overlapped);
+  }
+}
+
+static DWORD WINAPI fault_stall_callback(LPVOID data)
+{
+  fault_completion_t ready[FAULT_HELD_MAX];
+  LONG64 seen = -1;
+
+  for (;;)
+  {
+    Sleep(FAULT_STALL_MS);
+
+    int count = 0;
+    AcquireSRWLockExclusive(&fault_lock);
+    if (fault_held_count == 0)
+    {
+      fault_watching = false;
+      ReleaseSRWLockExclusive(&fault_lock);
+      return 0;
+    }
+
+    if (fault_clock == seen)
+    {
+      LONG64 earliest = fault_held[0].due;
+      for (int i = 1; i < fault_held_count; i++)
+      {
+        earliest = min(earliest, fault_held[i].due);
+      }
+      fault_clock = max(fault_clock, earliest);
+      count = fault_take_due(ready);
+      InterlockedIncrement(&fault_stalls);
+    }
+    seen = fault_clock;
+    ReleaseSRWLockExclusive(&fault_lock);
+
+    fault_release(ready, count);
+  }
+}
+
+// returns false if the table is full and the completion must be delivered now
+static bool fault_hold(LPOVERLAPPED_COMPLETION_ROUTINE routine, DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped, LONG64 after)
+{
+  bool watch = false;
+
+  AcquireSRWLockExclusive(&fault_lock);
+  if (fault_held_count == FAULT_HELD_MAX)
+  {
+    ReleaseSRWLockExclusive(&fault_lock);
+    return false;
+  }
+
+  fault_completion_t* completion = &fault_held[fault_held_count++];
+  completion->routine = routine;
+  completion->errorCode = errorCode;
+  completion->numBytes = numBytes;
+  completion->overlapped = overlapped;
+  completion->due = fault_clock + after;
+  completion->order = fault_order++;
+
+  if (!fault_watching)
+  {
+    fault_watching = true;
+    watch = true;
+  }
+  ReleaseSRWLockExclusive(&fault_lock);
+
+  if (watch && !QueueUserWorkItem(fault_stall_callback, NULL, WT_EXECUTELONGFUNCTION))
+  {
+    AcquireSRWLockExclusive(&fault_lock);
+    fault_watching = false;
+    ReleaseSRWLockExclusive(&fault_lock);
+  }
+  return true;
+}
+
+// ticks the clock for a delivered completion and delivers whatever has come due
+static void fault_tick()
+{
+  fault_completion_t ready[FAULT_HELD_MAX];
+
+  AcquireSRWLockExclusive(&fault_lock);
+  fault_clock++;
+  int count = fault_take_due(ready);
+  ReleaseSRWLockExclusive(&fault_lock);
+
+  fault_release(ready, count);
+}
+
+void fault_deliver(LPOVERLAPPED_COMPLETION_ROUTINE routine, DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  if (!g_fault.enabled)
+  {
+    routine(errorCode, numBytes, overlapped);
+    return;
+  }
+
+  fault_rng_t rng;
+  fault_seed(&rng, ((fault_overlapped_t*)overlapped)->key);
+
+  if (errorCode == ERROR_SUCCESS && fault_roll(&rng, g_fault.fail_permille))
+  {
+    InterlockedIncrement(&fault_failures);
+    errorCode = g_fault.fail_error;
+    numBytes = 0;
+  }
+
+  bool delay = g_fault.delay_max_completions > 0 && fault_roll(&rng, g_fault.delay_permille);
+  bool reorder = !delay && fault_roll(&rng, g_fault.reorder_permille);
+
+  if (delay || reorder)
+  {
+    // a reordered completion goes out right after the next one
+    LONG64 after = delay ? 1 + (LONG64)(fault_next(&rng) % g_fault.delay_max_completions) : 1;
+    if (fault_hold(routine, errorCode, numBytes, overlapped, after))
+    {
+      InterlockedIncrement(delay ? &fault_delays : &fault_reorders);
+      return;
+    }
+  }
+
+  routine(errorCode, numBytes, overlapped);
+  fault_tick();
+}
+
+DWORD fault_post_length(unsigned long long key, DWORD len)
+{
+  if (!g_fault.enabled || len < 2)
+  {
+    return len;
+  }
+
+  fault_rng_t rng;
+  fault_seed(&rng, key ^ FAULT_SALT_POST);
+
+  if (!fault_roll(&rng, g_fault.partial_permille))
+  {
+    return len;
+  }
+
+  InterlockedIncrement(&fault_partials);
+  return 1 + (DWORD)(fault_next(&rng) % (len - 1));
+}
+
+void fault_close_socket(SOCKET s, unsigned long long key)
+{
+  if (!g_fault.enabled)
+  {
+    closesocket(s);
+    return;
+  }
+
+  fault_rng_t rng;
+  fault_seed(&rng, key ^ FAULT_SALT_CLOSE);
+
+  if (fault_roll(&rng, g_fault.reset_permille))
+  {
+    // abortive close: the peer sees RST
+    InterlockedIncrement(&fault_resets);
+    LINGER linger_opt;
+    linger_opt.l_onoff = 1;
+    linger_opt.l_linger = 0;
+    setsockopt(s, SOL_SOCKET, SO_LINGER, (const char*)&linger_opt, sizeof(linger_opt));
+  }
+  else
+  {
+    // graceful close: the peer sees FIN
+    InterlockedIncrement(&fault_fins);
+    shutdown(s, SD_SEND);
+  }
+  closesocket(s);
+}
+
+void print_fault_counts()
+{
+  if (g_fault.enabled)
+  {
+    tsprintf("Fault: seed %llu; %ld delayed, %ld reordered, %ld failed, %ld partial, %ld reset, %ld fin, %ld stalls\n",
+      g_fault.seed, fault_delays, fault_reorders, fault_failures, fault_partials, fault_resets, fault_fins, fault_stalls);
+  }
+}
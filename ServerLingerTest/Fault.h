@@ -0,0 +1,69 @@
+#ifndef SERVER_LINGER_TEST_FAULT_H
+#define SERVER_LINGER_TEST_FAULT_H
+
+#include "Poll.h"
+#include "Profile.h"
+
+// fault injection at the completion routine boundary; every decision is drawn
+// from (seed, operation key), so it does not depend on completion order and a
+// run can be repeated exactly
+typedef struct fault_config_t
+{
+  bool enabled;
+  unsigned long long seed;
+
+  // chances are in parts per thousand of operations (or closes, for resets)
+  unsigned delay_permille;
+  unsigned delay_max_completions;
+  unsigned reorder_permille;
+  unsigned fail_permille;
+  DWORD fail_error;
+  unsigned partial_permille;
+  unsigned reset_permille;
+} fault_config_t;
+
+extern fault_config_t g_fault;
+
+// every overlapped context that completes through fault_deliver() keeps a
+// fault_key right after its OVERLAPPED; FAULT_KEYED() checks the layout
+typedef struct fault_overlapped_t
+{
+  OVERLAPPED ov;
+  unsigned long long key;
+} fault_overlapped_t;
+
+#define FAULT_KEYED(type) \
+  static_assert(offsetof(type, fault_key) == offsetof(fault_overlapped_t, key), #type " must keep fault_key after its OVERLAPPED")
+
+// names an operation by its stream (a connection or worker), its kind and the
+// stream's count of operations of that kind, which are posted one at a time
+inline unsigned long long fault_key(unsigned long long stream, unsigned kind, unsigned long long op)
+{
+  unsigned long long z = stream * 0x9e3779b97f4a7c15ULL ^ (op << 8 | kind);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+extern void fault_deliver(LPOVERLAPPED_COMPLETION_ROUTINE routine, DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped);
+
+// the length to post a send or recv with; a partial transfer is injected by
+// posting a shorter buffer, so callers must handle short sends
+extern DWORD fault_post_length(unsigned long long key, DWORD len);
+
+extern void fault_close_socket(SOCKET s, unsigned long long key);
+extern void print_fault_counts();
+
+template <LPOVERLAPPED_COMPLETION_ROUTINE routine>
+void WINAPI fault_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  PROFILE_SCOPE(PROFILE_HARVEST);
+  fault_deliver(routine, errorCode, numBytes, overlapped);
+}
+
+// use in place of BindIoCompletionCallback so completions pass through fault_deliver()
+// and are delivered by whichever engine bind_completion() selects
+#define COMPLETION_ROUTINE(routine) fault_completion_routine<routine>
+#define BIND_COMPLETION(handle, routine) bind_completion((HANDLE)(handle), COMPLETION_ROUTINE(routine))
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef SERVER_LINGER_TEST_MPSC_H
+#define SERVER_LINGER_TEST_MPSC_H
+
+#include <atomic>
+
+// intrusive multi-producer single-consumer queue (Vyukov); any thread may push,
+// only the owning thread may pop. Nodes are embedded as the first member.
+typedef struct mpsc_node_t
+{
+  std::atomic<mpsc_node_t*> next;
+} mpsc_node_t;
+
+typedef struct mpsc_queue_t
+{
+  std::atomic<mpsc_node_t*> head;
+  mpsc_node_t* tail;
+  mpsc_node_t stub;
+} mpsc_queue_t;
+
+inline void mpsc_init(mpsc_queue_t* queue)
+{
+  queue->stub.next.store(nullptr, std::memory_order_relaxed);
+  queue->head.store(&queue->stub, std::memory_order_relaxed);
+  queue->tail = &queue->stub;
+}
+
+inline void mpsc_push(mpsc_queue_t* queue, mpsc_node_t* node)
+{
+  node->next.store(nullptr, std::memory_order_relaxed);
+  mpsc_node_t* prev = queue->head.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+}
+
+// returns NULL when empty, or when a producer is between its exchange and its
+// link; that producer's own wakeup will bring the consumer back
+inline mpsc_node_t* mpsc_pop(mpsc_queue_t* queue)
+{
+  mpsc_node_t* tail = queue->tail;
+  mpsc_node_t* next = tail->next.load(std::memory_order_acquire);
+
+  if (tail == &queue->stub)
+  {
+    if (next == nullptr)
+      return nullptr;
+
+    queue->tail = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+
+  if (next != nullptr)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  if (tail != queue->head.load(std::memory_order_acquire))
+    return nullptr;
+
+  mpsc_push(queue, &queue->stub);
+
+  next = tail->next.load(std::memory_order_acquire);
+  if (next != nullptr)
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  return nullptr;
+}
+
+#endif
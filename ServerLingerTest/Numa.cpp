@@ -0,0 +1,163 @@
+#include "pch.h"
+#include "Numa.h"
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+static volatile LONG64 completions_local = 0;
+static volatile LONG64 completions_remote = 0;
+
+USHORT numa_node_count()
+{
+  ULONG highest = 0;
+  if (!GetNumaHighestNodeNumber(&highest))
+  {
+    return 1;
+  }
+  return (USHORT)(highest + 1);
+}
+
+USHORT numa_bind_thread(USHORT node)
+{
+  if (!g_numa_aware)
+  {
+    return NUMA_NODE_NONE;
+  }
+
+  GROUP_AFFINITY affinity = { 0 };
+  if (!GetNumaNodeProcessorMaskEx(node, &affinity) || affinity.Mask == 0
+    || !SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL))
+  {
+    tsprintf("Numa: unable to bind thread %d to node %d:\n", GetCurrentThreadId(), node);
+    printwindowserror(GetLastError());
+    return NUMA_NODE_NONE;
+  }
+
+  tsprintf("Numa: thread %d bound to node %d (group %d, mask %llx)\n", GetCurrentThreadId(), node,
+    affinity.Group, (unsigned long long)affinity.Mask);
+  return node;
+}
+
+USHORT numa_current_node()
+{
+  PROCESSOR_NUMBER processor;
+  GetCurrentProcessorNumberEx(&processor);
+
+  USHORT node = 0;
+  if (!GetNumaProcessorNodeEx(&processor, &node))
+  {
+    return NUMA_NODE_NONE;
+  }
+  return node;
+}
+
+bool numa_pool_init(numa_pool_t* pool, const char* name, USHORT node, size_t block_size, size_t count)
+{
+  memset(pool, 0, sizeof(numa_pool_t));
+  InitializeSListHead(&pool->free_list);
+  pool->name = name;
+  pool->node = node;
+
+  // whole cache lines, which also keeps every block aligned for the SLIST
+  pool->block_size = (block_size + 63) & ~(size_t)63;
+  pool->block_count = count;
+
+  pool->region = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL, pool->block_size * count,
+    MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+  if (pool->region == NULL)
+  {
+    tsprintf("%s: unable to commit %d blocks on node %d:\n", name, (int)count, node);
+    printwindowserror(GetLastError());
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    InterlockedPushEntrySList(&pool->free_list, (PSLIST_ENTRY)(pool->region + i * pool->block_size));
+  }
+  return true;
+}
+
+void numa_pool_destroy(numa_pool_t* pool)
+{
+  if (pool->region != NULL)
+  {
+    VirtualFree(pool->region, 0, MEM_RELEASE);
+    pool->region = NULL;
+  }
+  InitializeSListHead(&pool->free_list);
+}
+
+static bool numa_pool_owns(numa_pool_t* pool, void* block)
+{
+  return pool->region != NULL && (char*)block >= pool->region
+    && (char*)block < pool->region + pool->block_size * pool->block_count;
+}
+
+arena_t* numa_arena_create(numa_pool_t* pool, size_t size)
+{
+  if (pool->region == NULL || sizeof(arena_t) + size > pool->block_size)
+  {
+    return arena_create(size);
+  }
+
+  arena_t* arena = (arena_t*)InterlockedPopEntrySList(&pool->free_list);
+  if (arena == NULL)
+  {
+    InterlockedIncrement64(&pool->misses);
+    return arena_create(size);
+  }
+
+  InterlockedIncrement64(&pool->hits);
+  arena_init(arena, arena + 1, pool->block_size - sizeof(arena_t));
+  return arena;
+}
+
+void numa_arena_destroy(numa_pool_t* pool, arena_t* arena)
+{
+  if (numa_pool_owns(pool, arena))
+  {
+    InterlockedPushEntrySList(&pool->free_list, (PSLIST_ENTRY)arena);
+  }
+  else
+  {
+    arena_destroy(arena);
+  }
+}
+
+void numa_note_completion(USHORT home)
+{
+  if (home == NUMA_NODE_NONE)
+  {
+    return;
+  }
+
+  if (numa_current_node() == home)
+  {
+    InterlockedIncrement64(&completions_local);
+  }
+  else
+  {
+    InterlockedIncrement64(&completions_remote);
+  }
+}
+
+void print_numa_stats()
+{
+  if (!g_numa_aware)
+  {
+    return;
+  }
+
+  LONG64 total = completions_local + completions_remote;
+  tsprintf("Numa: %lld completions, %lld on the home node, %lld cross-node handoffs (%.1f%%)\n",
+    total, completions_local, completions_remote, total > 0 ? 100.0 * completions_remote / total : 0.0);
+}
+
+void print_numa_pool_stats(numa_pool_t* pool)
+{
+  if (pool->region != NULL)
+  {
+    tsprintf("%s: node %d pool: %lld hits, %lld misses\n", pool->name, pool->node, pool->hits, pool->misses);
+  }
+}
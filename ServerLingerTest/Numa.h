@@ -0,0 +1,46 @@
+#ifndef SERVER_LINGER_TEST_NUMA_H
+#define SERVER_LINGER_TEST_NUMA_H
+
+#include "Arena.h"
+
+// node-local placement for the owner threads and their per-connection memory.
+// Each side's thread is bound to a node and its connection arenas come from a
+// block pool committed on that node; completions count whether they ran there.
+extern bool g_numa_aware;
+
+constexpr USHORT NUMA_NODE_NONE = 0xffff;
+
+typedef struct numa_pool_t
+{
+  SLIST_HEADER free_list;
+  const char* name;
+  USHORT node;
+  char* region;
+  size_t block_size;
+  size_t block_count;
+  volatile LONG64 hits;
+  volatile LONG64 misses;
+} numa_pool_t;
+
+extern USHORT numa_node_count();
+
+// binds the calling thread to the processors of node; returns the node bound to,
+// or NUMA_NODE_NONE if NUMA placement is off or the binding failed
+extern USHORT numa_bind_thread(USHORT node);
+extern USHORT numa_current_node();
+
+// commits count blocks of block_size on node; the pool must not move once initialised
+extern bool numa_pool_init(numa_pool_t* pool, const char* name, USHORT node, size_t block_size, size_t count);
+extern void numa_pool_destroy(numa_pool_t* pool);
+
+// an arena laid out like arena_create()'s, taken from the pool when it has a
+// block and from malloc otherwise; release it with numa_arena_destroy()
+extern arena_t* numa_arena_create(numa_pool_t* pool, size_t size);
+extern void numa_arena_destroy(numa_pool_t* pool, arena_t* arena);
+
+// counts a completion for memory homed on node as local or as a cross-node handoff
+extern void numa_note_completion(USHORT home);
+extern void print_numa_stats();
+extern void print_numa_pool_stats(numa_pool_t* pool);
+
+#endif
@@ -0,0 +1,286 @@
+#include "pch.h"
+#include "Numa.h"
+#include "Poll.h"
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+typedef ULONG(WINAPI* rtl_nt_status_to_dos_error_t)(LONG status);
+
+constexpr int POLL_MAX_THREADS = 16;
+constexpr ULONG POLL_BATCH = 64;
+
+// empty zero-timeout polls before yielding the processor, and before blocking
+constexpr int POLL_SPIN_LIMIT = 4096;
+constexpr int POLL_YIELD_LIMIT = 4096 + 256;
+
+typedef struct poll_port_t
+{
+  HANDLE port;
+  USHORT node;
+  int threads;
+} poll_port_t;
+
+static poll_port_t poll_ports[POLL_MAX_THREADS];
+static int poll_port_count = 0;
+static HANDLE poll_threads[POLL_MAX_THREADS];
+static int poll_thread_count = 0;
+static rtl_nt_status_to_dos_error_t rtl_nt_status_to_dos_error = NULL;
+
+static volatile LONG64 poll_completions = 0;
+static volatile LONG64 poll_empty = 0;
+static volatile LONG64 poll_blocking_waits = 0;
+
+BOOL bind_completion_on_node(HANDLE handle, LPOVERLAPPED_COMPLETION_ROUTINE routine, USHORT node)
+{
+  if (poll_port_count == 0)
+  {
+    return BindIoCompletionCallback(handle, routine, 0);
+  }
+
+  // a node without a port of its own shares the first one
+  poll_port_t* port = &poll_ports[0];
+  for (int i = 1; i < poll_port_count; i++)
+  {
+    if (poll_ports[i].node == node)
+    {
+      port = &poll_ports[i];
+      break;
+    }
+  }
+
+  return CreateIoCompletionPort(handle, port->port, (ULONG_PTR)routine, 0) != NULL;
+}
+
+BOOL bind_completion(HANDLE handle, LPOVERLAPPED_COMPLETION_ROUTINE routine)
+{
+  return bind_completion_on_node(handle, routine, poll_port_count > 1 ? numa_current_node() : NUMA_NODE_NONE);
+}
+
+static DWORD WINAPI poll_thread(LPVOID data)
+{
+  poll_port_t* port = (poll_port_t*)data;
+  OVERLAPPED_ENTRY entries[POLL_BATCH];
+  int idle = 0;
+
+  if (port->node != NUMA_NODE_NONE)
+  {
+    numa_bind_thread(port->node);
+  }
+
+  while (true)
+  {
+    DWORD timeout = idle < POLL_YIELD_LIMIT ? 0 : INFINITE;
+    if (timeout == INFINITE)
+    {
+      InterlockedIncrement64(&poll_blocking_waits);
+    }
+
+    ULONG removed = 0;
+    if (!GetQueuedCompletionStatusEx(port->port, entries, POLL_BATCH, &removed, timeout, FALSE))
+    {
+      DWORD error = GetLastError();
+      if (error != WAIT_TIMEOUT)
+      {
+        tsprintf("Poll: ERROR waiting on the completion port:\n");
+        printwindowserror(error);
+        return EXIT_FAILURE;
+      }
+
+      InterlockedIncrement64(&poll_empty);
+      if (++idle > POLL_SPIN_LIMIT)
+      {
+        SwitchToThread();
+      }
+      else
+      {
+        YieldProcessor();
+      }
+      continue;
+    }
+
+    idle = 0;
+    InterlockedAdd64(&poll_completions, removed);
+
+    int stops = 0;
+    for (ULONG i = 0; i < removed; i++)
+    {
+      // poll_stop() posts a packet with no overlapped for each thread
+      if (entries[i].lpOverlapped == NULL)
+      {
+        stops++;
+        continue;
+      }
+
+      // the thread pool hands routines a Win32 error; the port leaves the NTSTATUS in Internal
+      LPOVERLAPPED_COMPLETION_ROUTINE routine = (LPOVERLAPPED_COMPLETION_ROUTINE)entries[i].lpCompletionKey;
+      DWORD errorCode = rtl_nt_status_to_dos_error((LONG)entries[i].Internal);
+      routine(errorCode, entries[i].dwNumberOfBytesTransferred, entries[i].lpOverlapped);
+    }
+
+    if (stops > 0)
+    {
+      // pass on the packets meant for the port's other threads
+      for (int i = 1; i < stops; i++)
+      {
+        PostQueuedCompletionStatus(port->port, 0, 0, NULL);
+      }
+      return EXIT_SUCCESS;
+    }
+  }
+}
+
+bool poll_start(int threads)
+{
+  rtl_nt_status_to_dos_error = (rtl_nt_status_to_dos_error_t)GetProcAddress(GetModuleHandleA("ntdll.dll"), "RtlNtStatusToDosError");
+  if (rtl_nt_status_to_dos_error == NULL)
+  {
+    tsprintf("Poll: unable to find RtlNtStatusToDosError\n");
+    return false;
+  }
+
+  // with NUMA placement on, a port per node and at least one thread for each
+  int ports = g_numa_aware ? min((int)numa_node_count(), POLL_MAX_THREADS) : 1;
+  threads = max(ports, min(threads, POLL_MAX_THREADS));
+
+  for (int i = 0; i < ports; i++)
+  {
+    // threads are dealt to the ports in turn
+    poll_port_t* port = &poll_ports[i];
+    port->node = g_numa_aware ? (USHORT)i : NUMA_NODE_NONE;
+    port->threads = 0;
+    port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, (threads - i + ports - 1) / ports);
+    if (port->port == NULL)
+    {
+      tsprintf("Poll: ERROR creating completion port:\n");
+      printwindowserror(GetLastError());
+      poll_stop();
+      return false;
+    }
+    poll_port_count++;
+  }
+
+  for (int i = 0; i < threads; i++)
+  {
+    poll_port_t* port = &poll_ports[i % ports];
+    poll_threads[i] = CreateThread(NULL, 0, poll_thread, port, 0, NULL);
+    if (poll_threads[i] == NULL)
+    {
+      tsprintf("Poll: ERROR creating poll thread:\n");
+      printwindowserror(GetLastError());
+      break;
+    }
+    port->threads++;
+    poll_thread_count++;
+  }
+
+  // a port nobody drains would strand every completion bound to it
+  if (poll_thread_count < ports)
+  {
+    poll_stop();
+    return false;
+  }
+
+  tsprintf("Poll: %d busy-poll completion threads on %d ports\n", poll_thread_count, poll_port_count);
+  return true;
+}
+
+void poll_stop()
+{
+  if (poll_port_count == 0)
+  {
+    return;
+  }
+
+  for (int i = 0; i < poll_port_count; i++)
+  {
+    for (int j = 0; j < poll_ports[i].threads; j++)
+    {
+      PostQueuedCompletionStatus(poll_ports[i].port, 0, 0, NULL);
+    }
+  }
+
+  if (poll_thread_count > 0)
+  {
+    WaitForMultipleObjects(poll_thread_count, poll_threads, TRUE, INFINITE);
+  }
+  for (int i = 0; i < poll_thread_count; i++)
+  {
+    CloseHandle(poll_threads[i]);
+  }
+  poll_thread_count = 0;
+
+  for (int i = 0; i < poll_port_count; i++)
+  {
+    CloseHandle(poll_ports[i].port);
+    poll_ports[i].port = NULL;
+  }
+  poll_port_count = 0;
+}
+
+void print_poll_stats()
+{
+  if (!g_busy_poll)
+  {
+    return;
+  }
+
+  tsprintf("Poll: %lld completions, %lld empty polls, %lld blocking waits\n",
+    poll_completions, poll_empty, poll_blocking_waits);
+}
+
+// one-microsecond buckets; anything slower lands in the last one
+constexpr int LATENCY_BUCKETS = 1000;
+
+static volatile LONG64 latency_counts[LATENCY_BUCKETS + 1];
+static volatile LONG64 latency_total = 0;
+static volatile LONG64 latency_max_us = 0;
+
+void latency_record(LONGLONG ticks)
+{
+  static LARGE_INTEGER frequency = { 0 };
+  if (frequency.QuadPart == 0)
+  {
+    QueryPerformanceFrequency(&frequency);
+  }
+
+  LONG64 us = ticks * 1000000 / frequency.QuadPart;
+  InterlockedIncrement64(&latency_counts[min(us, (LONG64)LATENCY_BUCKETS)]);
+  InterlockedIncrement64(&latency_total);
+
+  LONG64 peak = latency_max_us;
+  while (us > peak)
+  {
+    LONG64 prev = InterlockedCompareExchange64(&latency_max_us, us, peak);
+    if (prev == peak)
+      break;
+    peak = prev;
+  }
+}
+
+static LONG64 latency_percentile(double fraction)
+{
+  LONG64 target = (LONG64)(latency_total * fraction);
+  LONG64 seen = 0;
+  for (int i = 0; i <= LATENCY_BUCKETS; i++)
+  {
+    seen += latency_counts[i];
+    if (seen > target)
+    {
+      return i;
+    }
+  }
+  return LATENCY_BUCKETS;
+}
+
+void print_latency_stats()
+{
+  if (latency_total == 0)
+  {
+    return;
+  }
+
+  tsprintf("Latency: %lld round trips (%s): p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us\n",
+    latency_total, g_busy_poll ? "busy-poll" : "blocking",
+    latency_percentile(0.5), latency_percentile(0.99), latency_percentile(0.999), latency_max_us);
+}
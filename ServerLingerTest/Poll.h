@@ -0,0 +1,25 @@
+#ifndef SERVER_LINGER_TEST_POLL_H
+#define SERVER_LINGER_TEST_POLL_H
+
+// opt-in busy-poll completion delivery. Handles are associated with a private
+// completion port, keyed by their completion routine, which dedicated threads
+// drain with GetQueuedCompletionStatusEx at a zero timeout; after a stretch of
+// empty polls a thread backs off to a blocking wait. With g_busy_poll off,
+// completions are delivered by the system thread pool as before.
+extern bool g_busy_poll;
+
+extern bool poll_start(int threads);
+extern void poll_stop();
+
+// BindIoCompletionCallback, or association with the busy-poll port; with NUMA
+// placement on there is a port per node, drained by threads bound to that node,
+// and bind_completion() picks the calling thread's node
+extern BOOL bind_completion(HANDLE handle, LPOVERLAPPED_COMPLETION_ROUTINE routine);
+extern BOOL bind_completion_on_node(HANDLE handle, LPOVERLAPPED_COMPLETION_ROUTINE routine, USHORT node);
+extern void print_poll_stats();
+
+// round trips measured by the client in the echo test, in QPC ticks
+extern void latency_record(LONGLONG ticks);
+extern void print_latency_stats();
+
+#endif
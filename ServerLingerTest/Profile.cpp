@@ -0,0 +1,141 @@
+#include "pch.h"
+#include "Profile.h"
+#include <stdio.h>
+
+extern int tsprintf(const char* format, ...);
+
+#ifdef SLT_PROFILE
+
+typedef struct profile_event_t
+{
+  unsigned long long start;
+  unsigned long long end;
+  DWORD thread_id;
+  profile_stage_t stage;
+} profile_event_t;
+
+static const char* profile_stage_names[(int)profile_stage_t::PROFILE_STAGE_COUNT] =
+{
+  "alloc", "post", "harvest", "handler", "log", "free"
+};
+
+static volatile LONG64 stage_cycles[(int)profile_stage_t::PROFILE_STAGE_COUNT];
+static volatile LONG64 stage_counts[(int)profile_stage_t::PROFILE_STAGE_COUNT];
+
+static profile_event_t* trace_events = NULL;
+static LONG trace_capacity = 0;
+static volatile LONG trace_count = 0;
+static unsigned long long trace_start_tsc = 0;
+static volatile unsigned long long trace_end_tsc = 0;
+static double tsc_per_us = 0.0;
+
+void profile_record(profile_stage_t stage, unsigned long long start, unsigned long long end)
+{
+  InterlockedAdd64(&stage_cycles[(int)stage], (LONG64)(end - start));
+  InterlockedIncrement64(&stage_counts[(int)stage]);
+
+  if (end < trace_end_tsc)
+  {
+    LONG index = InterlockedIncrement(&trace_count) - 1;
+    if (index < trace_capacity)
+    {
+      profile_event_t* event = &trace_events[index];
+      event->start = start;
+      event->end = end;
+      event->thread_id = GetCurrentThreadId();
+      event->stage = stage;
+    }
+  }
+}
+
+// the TSC rate is measured against QPC so trace timestamps come out in microseconds
+static double calibrate_tsc()
+{
+  LARGE_INTEGER frequency, qpc_start, qpc_end;
+  QueryPerformanceFrequency(&frequency);
+
+  QueryPerformanceCounter(&qpc_start);
+  unsigned long long tsc_start = __rdtsc();
+  Sleep(50);
+  QueryPerformanceCounter(&qpc_end);
+  unsigned long long tsc_end = __rdtsc();
+
+  double us = (qpc_end.QuadPart - qpc_start.QuadPart) * 1e6 / frequency.QuadPart;
+  return (tsc_end - tsc_start) / us;
+}
+
+bool profile_trace_start(DWORD ms, LONG max_events)
+{
+  trace_events = (profile_event_t*)malloc(sizeof(profile_event_t) * max_events);
+  if (trace_events == NULL)
+  {
+    tsprintf("Profile: out of memory for %d trace events\n", max_events);
+    return false;
+  }
+
+  trace_capacity = max_events;
+  tsc_per_us = calibrate_tsc();
+  trace_start_tsc = __rdtsc();
+  trace_end_tsc = trace_start_tsc + (unsigned long long)(tsc_per_us * ms * 1000.0);
+
+  tsprintf("Profile: tracing for %d ms at %.0f MHz\n", ms, tsc_per_us);
+  return true;
+}
+
+bool profile_trace_write(const char* path)
+{
+  if (trace_events == NULL)
+  {
+    return false;
+  }
+
+  FILE* file = NULL;
+  if (fopen_s(&file, path, "w") != 0 || file == NULL)
+  {
+    tsprintf("Profile: unable to open %s\n", path);
+    return false;
+  }
+
+  LONG count = min(trace_count, trace_capacity);
+
+  fprintf(file, "{\"traceEvents\":[\n");
+  for (LONG i = 0; i < count; i++)
+  {
+    profile_event_t* event = &trace_events[i];
+    fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+      profile_stage_names[(int)event->stage], GetCurrentProcessId(), event->thread_id,
+      (event->start - trace_start_tsc) / tsc_per_us, (event->end - event->start) / tsc_per_us,
+      i + 1 < count ? "," : "");
+  }
+  fprintf(file, "],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(file);
+
+  tsprintf("Profile: wrote %d trace events to %s%s\n", count, path, trace_count > trace_capacity ? " (buffer full)" : "");
+
+  free(trace_events);
+  trace_events = NULL;
+  return true;
+}
+
+void print_profile_stats()
+{
+  tsprintf("Profile: %-8s %12s %16s %12s\n", "stage", "count", "cycles", "avg cycles");
+  for (int i = 0; i < (int)profile_stage_t::PROFILE_STAGE_COUNT; i++)
+  {
+    LONG64 count = stage_counts[i];
+    tsprintf("Profile: %-8s %12lld %16lld %12lld\n", profile_stage_names[i], count, stage_cycles[i], count > 0 ? stage_cycles[i] / count : 0);
+  }
+}
+
+#else
+
+bool profile_trace_start(DWORD ms, LONG max_events)
+{
+  tsprintf("Profile: not available; build with SLT_PROFILE\n");
+  return false;
+}
+
+bool profile_trace_write(const char* path) { return false; }
+void print_profile_stats() {}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SERVER_LINGER_TEST_PROFILE_H
+#define SERVER_LINGER_TEST_PROFILE_H
+
+// scoped cycle counters for the stages of the completion path; compiled in with
+// SLT_PROFILE, otherwise PROFILE_SCOPE expands to nothing. Scopes nest, so a
+// stage's cycles include those of any stage it calls (e.g. post includes alloc).
+enum class profile_stage_t
+{
+  PROFILE_ALLOC = 0,
+  PROFILE_POST = 1,
+  PROFILE_HARVEST = 2,
+  PROFILE_HANDLER = 3,
+  PROFILE_LOG = 4,
+  PROFILE_FREE = 5,
+  PROFILE_STAGE_COUNT = 6
+};
+
+// records every scope that ends within the next ms into a buffer of max_events,
+// written out as Chrome trace-event JSON by profile_trace_write()
+extern bool profile_trace_start(DWORD ms, LONG max_events);
+extern bool profile_trace_write(const char* path);
+extern void print_profile_stats();
+
+#ifdef SLT_PROFILE
+
+#include <intrin.h>
+
+extern void profile_record(profile_stage_t stage, unsigned long long start, unsigned long long end);
+
+typedef struct profile_scope_t
+{
+  profile_stage_t stage;
+  unsigned long long start;
+
+  profile_scope_t(profile_stage_t stage) : stage(stage), start(__rdtsc()) {}
+  ~profile_scope_t() { profile_record(stage, start, __rdtsc()); }
+} profile_scope_t;
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(stage) profile_scope_t PROFILE_CONCAT(profile_scope_, __LINE__)(profile_stage_t::stage)
+
+#else
+
+#define PROFILE_SCOPE(stage)
+
+#endif
+
+#endif
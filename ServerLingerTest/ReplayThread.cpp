@@ -0,0 +1,458 @@
+#include "pch.h"
+#include "Commands.h"
+#include "Errors.h"
+#include "Fault.h"
+#include "SocketPool.h"
+#include "Trace.h"
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+extern bool g_running;
+extern DWORD g_drain_timeout_ms;
+
+extern LPFN_CONNECTEX g_ConnectEx;
+
+extern char* g_serverHost;
+extern char* g_serverPort;
+
+extern command_queue_t g_clientCommands;
+
+extern const char* g_replay_file;
+extern double g_replay_speed;
+extern DWORD g_replay_max_gap_ms;
+extern int g_replay_fanout;
+
+// replays a captured trace: every trace connection gets g_replay_fanout sockets
+// from the socket pool, and each record becomes a send of the same size on all of
+// them at the record's offset divided by g_replay_speed. Gaps longer than
+// g_replay_max_gap_ms, if set, are cut down to it.
+constexpr int REPLAY_MAX_CONNECTIONS = SOCKET_POOL_MAX;
+constexpr UINT32 REPLAY_MAX_MESSAGE = 65536;
+constexpr DWORD REPLAY_CONNECT_TIMEOUT_MS = 5000;
+constexpr DWORD REPLAY_POLL_MS = 10;
+
+// below this much time to the next send the thread spins rather than sleeps
+constexpr double REPLAY_SPIN_US = 2000.0;
+
+enum class replay_kind_t
+{
+  REPLAY_KIND_CONNECT = 0,
+  REPLAY_KIND_SEND = 1
+};
+
+typedef struct replay_info_t
+{
+  OVERLAPPED ov;
+  unsigned long long fault_key;
+  replay_kind_t kind;
+  int slot;
+} replay_info_t;
+
+FAULT_KEYED(replay_info_t);
+
+typedef struct replay_connection_t
+{
+  SOCKET socket;
+  volatile LONG connected;
+  volatile LONG failed;
+  ULONG sends;
+} replay_connection_t;
+
+static replay_connection_t replay_connections[REPLAY_MAX_CONNECTIONS];
+static int replay_connection_count = 0;
+static socket_pool_t replay_pool;
+
+// every send goes out of this one read-only buffer
+static char* replay_payload = NULL;
+
+static volatile LONG replay_outstanding = 0;
+static volatile LONG replay_connects_done = 0;
+static volatile LONG replay_connects_failed = 0;
+static volatile LONG64 replay_bytes = 0;
+static volatile LONG64 replay_send_errors = 0;
+
+static replay_info_t* alloc_replay_info(replay_kind_t kind, int slot)
+{
+  replay_info_t* info = (replay_info_t*)malloc(sizeof(replay_info_t));
+  if (info != NULL)
+  {
+    memset(info, 0, sizeof(replay_info_t));
+    info->kind = kind;
+    info->slot = slot;
+    InterlockedIncrement(&replay_outstanding);
+  }
+  return info;
+}
+
+static void free_replay_info(replay_info_t* info)
+{
+  free(info);
+  InterlockedDecrement(&replay_outstanding);
+}
+
+static void complete_replay_connect(replay_connection_t* conn)
+{
+  setsockopt(conn->socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+  InterlockedExchange(&conn->connected, 1);
+  InterlockedIncrement(&replay_connects_done);
+}
+
+static void __stdcall replay_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  replay_info_t* info = (replay_info_t*)overlapped;
+  replay_connection_t* conn = &replay_connections[info->slot];
+
+  switch (info->kind)
+  {
+  case replay_kind_t::REPLAY_KIND_CONNECT:
+    if (errorCode == ERROR_SUCCESS)
+    {
+      complete_replay_connect(conn);
+    }
+    else
+    {
+      report_completion_error("Replay", "connect", conn->socket, overlapped, errorCode);
+      InterlockedExchange(&conn->failed, 1);
+      InterlockedIncrement(&replay_connects_failed);
+      InterlockedIncrement(&replay_connects_done);
+    }
+    break;
+
+  case replay_kind_t::REPLAY_KIND_SEND:
+    if (errorCode == ERROR_SUCCESS)
+    {
+      InterlockedAdd64(&replay_bytes, numBytes);
+    }
+    else
+    {
+      report_completion_error("Replay", "send", conn->socket, overlapped, errorCode);
+      InterlockedIncrement64(&replay_send_errors);
+    }
+    break;
+  }
+
+  free_replay_info(info);
+}
+
+static bool start_replay_connect(int slot, const struct sockaddr_storage* addr, int addr_len)
+{
+  replay_connection_t* conn = &replay_connections[slot];
+
+  // already created, bound and bound to replay_completion_routine
+  conn->socket = socket_pool_acquire(&replay_pool);
+  if (conn->socket == INVALID_SOCKET)
+  {
+    tsprintf("Replay: unable to create socket %d:\n", slot);
+    printwindowserror(WSAGetLastError());
+    return false;
+  }
+
+  replay_info_t* info = alloc_replay_info(replay_kind_t::REPLAY_KIND_CONNECT, slot);
+  if (info == NULL)
+  {
+    tsprintf("Replay: out of memory\n");
+    return false;
+  }
+  info->fault_key = fault_key(slot, (unsigned)replay_kind_t::REPLAY_KIND_CONNECT, 0);
+
+  if (!g_ConnectEx(conn->socket, (const struct sockaddr*)addr, addr_len, NULL, 0, NULL, &info->ov))
+  {
+    DWORD error = GetLastError();
+    if (error != ERROR_IO_PENDING)
+    {
+      report_error("Replay", "start connect", error);
+      free_replay_info(info);
+      return false;
+    }
+  }
+  return true;
+}
+
+// a send for a slot whose connect has not completed waits for it, up to the
+// connect timeout, rather than being dropped
+static bool replay_send(int slot, UINT32 size)
+{
+  replay_connection_t* conn = &replay_connections[slot];
+
+  ULONGLONG deadline = GetTickCount64() + REPLAY_CONNECT_TIMEOUT_MS;
+  while (!conn->connected && !conn->failed && g_running && GetTickCount64() < deadline)
+  {
+    SleepEx(REPLAY_POLL_MS, true);
+  }
+
+  if (!conn->connected)
+  {
+    return false;
+  }
+
+  replay_info_t* info = alloc_replay_info(replay_kind_t::REPLAY_KIND_SEND, slot);
+  if (info == NULL)
+  {
+    return false;
+  }
+  info->fault_key = fault_key(slot, (unsigned)replay_kind_t::REPLAY_KIND_SEND, ++conn->sends);
+
+  WSABUF buf;
+  buf.buf = replay_payload;
+  buf.len = min(size, REPLAY_MAX_MESSAGE);
+  DWORD bytesSent;
+
+  if (WSASend(conn->socket, &buf, 1, &bytesSent, 0, &info->ov, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    if (error != WSA_IO_PENDING)
+    {
+      report_error("Replay", "start send", error);
+      InterlockedIncrement64(&replay_send_errors);
+      free_replay_info(info);
+      return false;
+    }
+  }
+  return true;
+}
+
+// the server reports the address it is listening on, which is the unspecified
+// address when it listens on all of them; that is reached through loopback
+static const char* replay_connect_host()
+{
+  if (g_serverHost == NULL || g_serverHost[0] == 0 || strcmp(g_serverHost, "0.0.0.0") == 0)
+  {
+    return "127.0.0.1";
+  }
+  if (strcmp(g_serverHost, "::") == 0)
+  {
+    return "::1";
+  }
+  return g_serverHost;
+}
+
+// the replay only starts once every connection is up; a connect that failed or is
+// still pending at the timeout would skew the trace's timing and fanout
+static bool connect_all(int count)
+{
+  struct sockaddr_storage server_addr;
+  int server_addr_len;
+  const char* host = replay_connect_host();
+
+  if (!resolve_endpoint(host, g_serverPort, &server_addr, &server_addr_len))
+  {
+    tsprintf("Replay: unable to get address info for %s:%s:\n", host, g_serverPort);
+    printwindowserror(WSAGetLastError());
+    return false;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (!start_replay_connect(i, &server_addr, server_addr_len))
+    {
+      InterlockedExchange(&replay_connections[i].failed, 1);
+      InterlockedIncrement(&replay_connects_failed);
+      InterlockedIncrement(&replay_connects_done);
+    }
+    replay_connection_count++;
+  }
+
+  ULONGLONG deadline = GetTickCount64() + REPLAY_CONNECT_TIMEOUT_MS;
+  while (g_running && replay_connects_done < count && GetTickCount64() < deadline)
+  {
+    SleepEx(REPLAY_POLL_MS, true);
+  }
+
+  LONG done = replay_connects_done;
+  LONG failed = replay_connects_failed;
+  tsprintf("Replay: %d of %d connections established\n", done - failed, count);
+
+  if (done < count || failed > 0)
+  {
+    tsprintf("Replay: %d connects failed and %d still pending; not replaying\n", failed, count - done);
+    return false;
+  }
+  return true;
+}
+
+static double elapsed_us(const LARGE_INTEGER* start, const LARGE_INTEGER* frequency)
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (now.QuadPart - start->QuadPart) * 1e6 / frequency->QuadPart;
+}
+
+static void replay_records(const trace_map_t* map, int trace_slots, int fanout)
+{
+  const trace_header_t* header = map->header;
+
+  LARGE_INTEGER frequency, start;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+
+  double due_us = 0;
+  double max_late_us = 0;
+  UINT64 previous_offset = 0;
+  UINT64 sent = 0;
+  UINT64 skipped = 0;
+  UINT64 i = 0;
+
+  for (; i < header->record_count && g_running; i++)
+  {
+    const trace_record_t* record = &map->records[i];
+
+    double gap_us = (record->offset_us - previous_offset) / g_replay_speed;
+    previous_offset = record->offset_us;
+    if (g_replay_max_gap_ms > 0)
+    {
+      gap_us = min(gap_us, g_replay_max_gap_ms * 1000.0);
+    }
+    due_us += gap_us;
+
+    double now_us;
+    while ((now_us = elapsed_us(&start, &frequency)) < due_us && g_running)
+    {
+      double remaining = due_us - now_us;
+      if (remaining > REPLAY_SPIN_US)
+      {
+        SleepEx((DWORD)((remaining - REPLAY_SPIN_US) / 1000) + 1, true);
+      }
+      else
+      {
+        YieldProcessor();
+      }
+    }
+    max_late_us = max(max_late_us, now_us - due_us);
+
+    int base = (int)((record->connection - 1) % trace_slots) * fanout;
+    for (int f = 0; f < fanout; f++)
+    {
+      if (replay_send(base + f, record->size))
+      {
+        sent++;
+      }
+      else
+      {
+        skipped++;
+      }
+    }
+  }
+
+  double total_s = elapsed_us(&start, &frequency) / 1e6;
+  tsprintf("Replay: %llu of %llu records replayed in %.3f s (trace %.3f s at %.2fx); %llu sends, %llu skipped\n",
+    i, header->record_count, total_s, header->duration_us / 1e6, g_replay_speed, sent, skipped);
+  tsprintf("Replay: %lld KB sent, %lld send errors, at most %.0f us behind schedule\n",
+    replay_bytes / 1024, replay_send_errors, max_late_us);
+}
+
+static void close_replay_connections()
+{
+  // the sends still in flight go out before the sockets are half-closed
+  ULONGLONG deadline = GetTickCount64() + g_drain_timeout_ms;
+  while (replay_outstanding > 0 && GetTickCount64() < deadline)
+  {
+    SleepEx(REPLAY_POLL_MS, true);
+  }
+
+  for (int i = 0; i < replay_connection_count; i++)
+  {
+    replay_connection_t* conn = &replay_connections[i];
+    if (conn->socket != INVALID_SOCKET)
+    {
+      shutdown(conn->socket, SD_SEND);
+      closesocket(conn->socket);
+      conn->socket = INVALID_SOCKET;
+    }
+  }
+  replay_connection_count = 0;
+
+  deadline = GetTickCount64() + REPLAY_CONNECT_TIMEOUT_MS;
+  while (replay_outstanding > 0 && GetTickCount64() < deadline)
+  {
+    SleepEx(REPLAY_POLL_MS, true);
+  }
+
+  if (replay_outstanding > 0)
+  {
+    tsprintf("Replay: %d operations still outstanding\n", replay_outstanding);
+  }
+}
+
+DWORD WINAPI ReplayClientThread(LPVOID data)
+{
+  command_queue_attach(&g_clientCommands, command_wakeup_only);
+
+  tsprintf("Replay: running...\n");
+
+  trace_map_t map;
+  if (!trace_map_open(&map, g_replay_file))
+  {
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+
+  const trace_header_t* header = map.header;
+  tsprintf("Replay: %s has %llu records on %d connections over %.3f s\n", g_replay_file,
+    header->record_count, header->connection_count, header->duration_us / 1e6);
+
+  if (header->record_count == 0 || header->connection_count == 0 || g_replay_speed <= 0)
+  {
+    trace_map_close(&map);
+    command_queue_detach(&g_clientCommands);
+    return EXIT_SUCCESS;
+  }
+
+  int fanout = max(1, min(g_replay_fanout, REPLAY_MAX_CONNECTIONS));
+  int trace_slots = min((int)header->connection_count, REPLAY_MAX_CONNECTIONS / fanout);
+  if (trace_slots < (int)header->connection_count)
+  {
+    tsprintf("Replay: %d trace connections folded onto %d\n", header->connection_count, trace_slots);
+  }
+
+  replay_payload = (char*)malloc(REPLAY_MAX_MESSAGE);
+  if (replay_payload == NULL)
+  {
+    tsprintf("Replay: out of memory\n");
+    trace_map_close(&map);
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+  memset(replay_payload, 'r', REPLAY_MAX_MESSAGE);
+
+  for (int i = 0; i < REPLAY_MAX_CONNECTIONS; i++)
+  {
+    replay_connections[i].socket = INVALID_SOCKET;
+  }
+
+  socket_pool_init(&replay_pool, "Replay", COMPLETION_ROUTINE(replay_completion_routine), trace_slots * fanout);
+
+  // the port is only known once the server thread is listening
+  while (g_running && g_serverPort[0] == 0)
+  {
+    SleepEx(1, true);
+  }
+
+  // a shutdown before the server is listening is not a failure
+  bool connected = !g_running || connect_all(trace_slots * fanout);
+  if (connected && g_running)
+  {
+    replay_records(&map, trace_slots, fanout);
+  }
+
+  close_replay_connections();
+  socket_pool_destroy(&replay_pool);
+  print_socket_pool_stats(&replay_pool);
+
+  trace_map_close(&map);
+  if (replay_outstanding == 0)
+  {
+    free(replay_payload);
+    replay_payload = NULL;
+  }
+
+  command_queue_detach(&g_clientCommands);
+  if (!connected)
+  {
+    tsprintf("Replay: exiting with failure\n");
+    return EXIT_FAILURE;
+  }
+
+  tsprintf("Replay: exiting with success\n");
+  return EXIT_SUCCESS;
+}
@@ -1,27 +1,113 @@
 
 #include "pch.h"
+#include "Commands.h"
+#include "Fault.h"
+#include "Numa.h"
+#include "Poll.h"
+#include "Profile.h"
+#include "Tls.h"
+#include "Trace.h"
 
 extern int tsprintf(const char* format, ...);
 extern void printwindowserror(int err);
+extern void print_error_counts();
 
 extern BOOL WINAPI CtrlHandler(DWORD dwEvent);
 extern DWORD WINAPI ServerThread(LPVOID data);
 extern DWORD WINAPI ClientThread(LPVOID data);
+extern DWORD WINAPI ChurnServerThread(LPVOID data);
+extern DWORD WINAPI ChurnClientThread(LPVOID data);
+extern DWORD WINAPI UdpServerThread(LPVOID data);
+extern DWORD WINAPI UdpClientThread(LPVOID data);
+extern DWORD WINAPI ReplayClientThread(LPVOID data);
 
 constexpr auto NUM_THREADS = 2;
 
 bool g_test_closed_connection = true;
 
+// connection churn stress mode; g_churn_linger is -1 for the system default,
+// 0 for an abortive close, or the SO_LINGER timeout in seconds
+bool g_test_churn = false;
+int g_churn_linger = -1;
+
+// datagram engine and packets-per-second load generator instead of TCP
+bool g_test_udp = false;
+
+// the server echoes every message and the client times round trips one at a time
+bool g_test_echo = false;
+
+// dedicated threads spin on a private completion port instead of the system
+// thread pool blocking for completions; see Poll.h
+bool g_busy_poll = false;
+int g_busy_poll_threads = 1;
+
+// the server records every message it receives to g_capture_file; see Trace.h
+const char* g_capture_file = NULL;
+
+// replays g_replay_file against the server instead of the "MSG %d" client, at
+// g_replay_speed times the recorded rate, with idle gaps capped at
+// g_replay_max_gap_ms (0 keeps them) and each trace connection on
+// g_replay_fanout sockets
+const char* g_replay_file = NULL;
+double g_replay_speed = 1.0;
+DWORD g_replay_max_gap_ms = 0;
+int g_replay_fanout = 1;
+
+// the server keeps every accepted connection open instead of one at a time;
+// replaying turns this on
+bool g_server_accept_many = false;
+
+// TLS between the completion routines and the handlers; see Tls.h
+bool g_use_tls = false;
+
+// with g_use_tls, times in-memory handshakes for this long before the run starts,
+// so the handshake rate of the TLS stage is reported apart from the sockets; 0 skips it
+DWORD g_tls_bench_ms = 0;
+
+// binds the server and client threads to NUMA nodes and commits their connection
+// memory there; see Numa.h
+bool g_numa_aware = false;
+
+// on shutdown, how long a connection gets to finish its sends and exchange FINs
+// before it is reset
+DWORD g_drain_timeout_ms = 5000;
+
+// deterministic fault injection; see Fault.h
+fault_config_t g_fault =
+{
+  false,                      // enabled
+  1,                          // seed
+  50, 20,                     // delay chance, max delay in completions
+  50,                         // reorder chance
+  10, ERROR_NETNAME_DELETED,  // failure chance, injected error
+  50,                         // partial transfer chance
+  500                         // reset (vs fin) chance on close
+};
+
+// with SLT_PROFILE defined, records the first g_profile_trace_ms of the run as
+// Chrome trace events (load in chrome://tracing or Perfetto); 0 disables
+DWORD g_profile_trace_ms = 0;
+LONG g_profile_trace_events = 1 << 20;
+const char* g_profile_trace_file = "slt_trace.json";
+
 bool g_running = true;
 bool g_client_can_connect = true;
 
 LPFN_ACCEPTEX g_AcceptEx = NULL;
 LPFN_CONNECTEX g_ConnectEx = NULL;
 LPFN_DISCONNECTEX g_DisconnectEx = NULL;
+LPFN_WSARECVMSG g_WSARecvMsg = NULL;
 
 char *g_serverHost = NULL;
 char *g_serverPort = NULL;
 
+command_queue_t g_serverCommands;
+command_queue_t g_clientCommands;
+
+// Ctrl-Break shuts down like Ctrl-C; with this set it instead posts COMMAND_CLOSE
+// to the server thread, which closes its current connection and keeps running
+bool g_ctrl_break_closes = false;
+
 LPVOID g_pThreadData[NUM_THREADS];
 HANDLE g_hThreads[NUM_THREADS];
 DWORD g_dwThreadIds[NUM_THREADS];
@@ -44,6 +130,12 @@ static int init_wsa()
   GUID guid;
   DWORD dwSize;
   SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (s == INVALID_SOCKET)
+  {
+    printwindowserror(WSAGetLastError());
+    WSACleanup();
+    return 6;
+  }
 
   guid = WSAID_CONNECTEX;
   if (WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &g_ConnectEx, sizeof(g_ConnectEx), &dwSize, NULL, NULL) == SOCKET_ERROR)
@@ -73,17 +165,60 @@ static int init_wsa()
   }
 
   closesocket(s);
+
+  // WSARecvMsg is only handed out for datagram sockets, and only the UDP mode needs it
+  s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  guid = WSAID_WSARECVMSG;
+  if (s == INVALID_SOCKET
+    || WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &g_WSARecvMsg, sizeof(g_WSARecvMsg), &dwSize, NULL, NULL) == SOCKET_ERROR)
+  {
+    g_WSARecvMsg = NULL;
+    if (g_test_udp)
+    {
+      printwindowserror(WSAGetLastError());
+      if (s != INVALID_SOCKET)
+      {
+        closesocket(s);
+      }
+      WSACleanup();
+      return 10;
+    }
+  }
+
+  if (s != INVALID_SOCKET)
+  {
+    closesocket(s);
+  }
   return 0;
 }
 
 //
 static int init_threads()
 {
+  LPTHREAD_START_ROUTINE server_thread = ServerThread;
+  LPTHREAD_START_ROUTINE client_thread = ClientThread;
+
+  if (g_test_churn)
+  {
+    server_thread = ChurnServerThread;
+    client_thread = ChurnClientThread;
+  }
+  else if (g_test_udp)
+  {
+    server_thread = UdpServerThread;
+    client_thread = UdpClientThread;
+  }
+  else if (g_replay_file != NULL)
+  {
+    client_thread = ReplayClientThread;
+  }
+
   g_pThreadData[0] = &g_running;
   g_hThreads[0] = CreateThread(
     NULL,
     0,
-    ServerThread,
+    server_thread,
     g_pThreadData[0],
     0,
     &g_dwThreadIds[0]
@@ -99,7 +234,7 @@ static int init_threads()
   g_hThreads[1] = CreateThread(
     NULL,
     0,
-    ClientThread,
+    client_thread,
     g_pThreadData[1],
     0,
     &g_dwThreadIds[1]
@@ -155,6 +290,65 @@ int main()
     return result;
   }
 
+  if (g_use_tls && !tls_init())
+  {
+    WSACleanup();
+    return 9;
+  }
+
+  if (g_use_tls && g_tls_bench_ms > 0 && !tls_bench_handshakes(g_tls_bench_ms))
+  {
+    tls_cleanup();
+    WSACleanup();
+    return 13;
+  }
+
+  if (g_fault.enabled)
+  {
+    tsprintf("Fault: injecting faults with seed %llu\n", g_fault.seed);
+  }
+
+  if (g_busy_poll && !poll_start(g_busy_poll_threads))
+  {
+    tls_cleanup();
+    WSACleanup();
+    return 11;
+  }
+
+  if (g_replay_file != NULL)
+  {
+    // the listener has to stay open for the replay's many connections
+    g_server_accept_many = true;
+    g_test_closed_connection = false;
+  }
+  else if (g_test_echo)
+  {
+    // the echo client needs a server that accepts it and lets it connect, not
+    // the closed-connection test
+    g_test_closed_connection = false;
+  }
+
+  if (g_capture_file != NULL && !trace_capture_open(g_capture_file))
+  {
+    poll_stop();
+    tls_cleanup();
+    WSACleanup();
+    return 12;
+  }
+
+  if (g_numa_aware)
+  {
+    tsprintf("Numa: %d nodes\n", numa_node_count());
+  }
+
+  if (g_profile_trace_ms > 0)
+  {
+    profile_trace_start(g_profile_trace_ms, g_profile_trace_events);
+  }
+
+  command_queue_init(&g_serverCommands, "server");
+  command_queue_init(&g_clientCommands, "client");
+
   // thread setup
   if ((result = init_threads()) != 0)
   {
@@ -174,6 +368,23 @@ int main()
     return result;
   }
 
+  // every socket is closed by now, so nothing more arrives on the port
+  poll_stop();
+  trace_capture_close();
+
+  print_error_counts();
+  print_command_stats(&g_serverCommands);
+  print_command_stats(&g_clientCommands);
+  print_fault_counts();
+  print_tls_stats();
+  tls_cleanup();
+
+  print_poll_stats();
+  print_latency_stats();
+  print_numa_stats();
+  print_profile_stats();
+  profile_trace_write(g_profile_trace_file);
+
   // clean up wsa
   WSACleanup();
 
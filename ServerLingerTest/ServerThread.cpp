@@ -1,9 +1,22 @@
 #include "pch.h"
+#include "Arena.h"
+#include "Commands.h"
+#include "Connection.h"
+#include "Errors.h"
+#include "Fault.h"
+#include "Numa.h"
+#include "Profile.h"
+#include "Tls.h"
+#include "Trace.h"
 
 extern int tsprintf(const char* format, ...);
 extern void printwindowserror(int err);
 
 extern bool g_test_closed_connection;
+extern bool g_use_tls;
+extern bool g_test_echo;
+extern bool g_server_accept_many;
+extern DWORD g_drain_timeout_ms;
 
 extern bool g_running;
 extern bool g_client_can_connect;
@@ -14,33 +27,44 @@ extern char* g_serverPort;
 extern LPFN_ACCEPTEX g_AcceptEx;
 extern LPFN_DISCONNECTEX g_DisconnectEx;
 
+extern command_queue_t g_serverCommands;
+
 static SOCKET listen_socket = INVALID_SOCKET;
 static bool accepting = false;
+
+// set by a failed accept completion, real or injected; the server thread then
+// drops what the accept left behind and posts the next one
+static volatile LONG accept_failed = 0;
 static SOCKET new_socket = INVALID_SOCKET;
 static SOCKET accepted_socket = INVALID_SOCKET;
 
-constexpr size_t READ_BUFFER_SIZE = 1024;
-static char read_buffer[READ_BUFFER_SIZE];
-
-enum class iocp_info_kind_t
-{
-  IOCP_KIND_ACCEPT = 0,
-  IOCP_KIND_RECV = 1,
-  IOCP_KIND_DISCONNECT = 3
-};
-
-constexpr size_t IOCP_ACCEPT_ADDR_LEN = sizeof(struct sockaddr_storage) + 16;
-
-typedef struct iocp_info_t
-{
-  OVERLAPPED ov;
-  iocp_info_kind_t kind;
-  SOCKET socket;
-  char buf[IOCP_ACCEPT_ADDR_LEN * 2];
-} iocp_info_t;
+// the connection for new_socket / accepted_socket
+static connection_t* connection = NULL;
+
+// in accept-many mode, earlier connections stay here with the server's reference
+// until the drain; only the server thread touches the table
+constexpr int SERVER_MAX_CONNECTIONS = 256;
+static connection_t* parked_connections[SERVER_MAX_CONNECTIONS];
+static int parked_count = 0;
+
+// connection arenas are committed on the server thread's node when NUMA placement is on
+constexpr size_t CONNECTION_POOL_BLOCKS = 64;
+static numa_pool_t connection_pool;
+static USHORT server_node = NUMA_NODE_NONE;
+
+static volatile LONG connections_created = 0;
+static volatile LONG connections_live = 0;
+static volatile LONG connections_released = 0;
+static LONG connections_drained = 0;
+static LONG connections_reaped = 0;
+static LONG connections_reset = 0;
+static volatile LONG64 connection_bytes_total = 0;
+static volatile LONG connection_bytes_peak = 0;
 
 static iocp_info_t* alloc_iocp(iocp_info_kind_t kind, SOCKET socket)
 {
+  PROFILE_SCOPE(PROFILE_ALLOC);
+
   iocp_info_t* info = (iocp_info_t*)malloc(sizeof(iocp_info_t));
   if (info != NULL)
   {
@@ -51,6 +75,108 @@ static iocp_info_t* alloc_iocp(iocp_info_kind_t kind, SOCKET socket)
   return info;
 }
 
+static connection_t* create_connection(SOCKET s)
+{
+  PROFILE_SCOPE(PROFILE_ALLOC);
+
+  arena_t* arena = numa_arena_create(&connection_pool, connection_arena_size(g_use_tls || g_test_echo));
+  if (arena == NULL)
+  {
+    return NULL;
+  }
+
+  connection_t* conn = (connection_t*)arena_alloc(arena, sizeof(connection_t));
+  if (conn == NULL)
+  {
+    numa_arena_destroy(&connection_pool, arena);
+    return NULL;
+  }
+
+  conn->arena = arena;
+  conn->home_node = server_node;
+  conn->refs = 1;
+  conn->socket = s;
+  conn->fault_stream = (UINT32)InterlockedIncrement(&connections_created);
+  conn->read_buffer = (char*)arena_alloc(arena, READ_BUFFER_SIZE);
+  conn->print_buffer = (char*)arena_alloc(arena, READ_BUFFER_SIZE);
+  if (g_use_tls || g_test_echo)
+  {
+    conn->send_buffer = (char*)arena_alloc(arena, TLS_BUFFER_SIZE);
+  }
+
+  // connection_arena_size() covers all of these, so a miss means it is out of date
+  if (conn->read_buffer == NULL || conn->print_buffer == NULL || ((g_use_tls || g_test_echo) && conn->send_buffer == NULL))
+  {
+    tsprintf("Server: connection arena of %d bytes is too small\n", (int)arena->size);
+    numa_arena_destroy(&connection_pool, arena);
+    return NULL;
+  }
+
+  InterlockedIncrement(&connections_live);
+  return conn;
+}
+
+static void release_connection(connection_t* conn)
+{
+  if (InterlockedDecrement(&conn->refs) != 0)
+  {
+    return;
+  }
+
+  PROFILE_SCOPE(PROFILE_FREE);
+
+  tls_destroy(conn->tls);
+  free(conn->send_command);
+
+  LONG used = (LONG)conn->arena->used;
+
+  InterlockedIncrement(&connections_released);
+  InterlockedAdd64(&connection_bytes_total, used);
+
+  LONG peak = connection_bytes_peak;
+  while (used > peak)
+  {
+    LONG prev = InterlockedCompareExchange(&connection_bytes_peak, used, peak);
+    if (prev == peak)
+      break;
+    peak = prev;
+  }
+
+  numa_arena_destroy(&connection_pool, conn->arena);
+  InterlockedDecrement(&connections_live);
+}
+
+// takes a reference on the connection; slot, if given, keeps the info for reuse
+static iocp_info_t* connection_iocp(connection_t* conn, iocp_info_kind_t kind, iocp_info_t** slot = NULL)
+{
+  PROFILE_SCOPE(PROFILE_ALLOC);
+
+  iocp_info_t* info = slot != NULL ? *slot : NULL;
+  if (info == NULL)
+  {
+    info = (iocp_info_t*)arena_alloc(conn->arena, sizeof(iocp_info_t));
+    if (info == NULL)
+    {
+      return NULL;
+    }
+    if (slot != NULL)
+    {
+      *slot = info;
+    }
+  }
+
+  memset(&info->ov, 0, sizeof(OVERLAPPED));
+  info->kind = kind;
+  info->socket = conn->socket;
+  info->connection = conn;
+
+  // operations of one kind are posted one at a time, so the count is stable
+  info->fault_key = fault_key(conn->fault_stream, (unsigned)kind, conn->fault_ops[(int)kind]++);
+
+  InterlockedIncrement(&conn->refs);
+  return info;
+}
+
 bool get_socket_name(sockaddr* addr, char* hostName, char* servName)
 {
   socklen_t actual_address_length = sizeof(struct sockaddr_storage);
@@ -58,59 +184,191 @@ bool get_socket_name(sockaddr* addr, char* hostName, char* servName)
 }
 
 static bool complete_accept(SOCKET s);
-static bool start_recv(SOCKET s);
+static bool start_recv(connection_t* conn);
+static bool start_send(connection_t* conn);
+static bool start_echo(connection_t* conn, int length);
+static bool post_send(connection_t* conn);
 
-static char print_buffer[READ_BUFFER_SIZE - 1];
+static void capture_read(connection_t* conn, int length)
+{
+  if (length > 0 && trace_capturing())
+  {
+    // recv completions on one connection never overlap, so this needs no lock
+    if (conn->trace_id == 0)
+    {
+      conn->trace_id = trace_capture_connection();
+    }
+    trace_capture_record(conn->trace_id, (UINT32)length);
+  }
+}
 
-static void print_wsa_error(SOCKET socket, LPOVERLAPPED overlapped)
+static void print_read(connection_t* conn, int length)
 {
-  DWORD numBytes;
-  DWORD flags;
-  WSAGetOverlappedResult(socket, overlapped, &numBytes, false, &flags);
-  DWORD error = GetLastError();
-  tsprintf("%x ", error);
-  printwindowserror(error);
+  memset(conn->print_buffer, 0, READ_BUFFER_SIZE);
+  memcpy(conn->print_buffer, conn->read_buffer, min(length, (int)READ_BUFFER_SIZE - 1));
+
+  tsprintf("Server: read %d bytes: '%s'\n", length, conn->print_buffer);
+}
+
+// handles length bytes that tls_recv() decrypted into read_buffer, then calls it
+// again without new ciphertext until the session has nothing buffered, since each
+// call stops at READ_BUFFER_SIZE - 1; false if the session failed or an echo is
+// waiting in read_buffer for room, and then no recv may be posted
+static bool read_tls_plaintext(connection_t* conn, int length)
+{
+  while (length > 0)
+  {
+    capture_read(conn, length);
+
+    if (!g_test_echo)
+    {
+      print_read(conn, length);
+    }
+    else if (!tls_queue(conn->tls, conn->read_buffer, length))
+    {
+      // the TLS stage is full; the echo waits in read_buffer and no recv is
+      // posted until a send completion has made room for it
+      conn->echo_backlog = length;
+      start_send(conn);
+      return false;
+    }
+
+    length = tls_recv(conn->tls, conn->read_buffer, 0, READ_BUFFER_SIZE - 1);
+  }
+
+  // handshake records and the echoes queued above
+  start_send(conn);
+
+  if (length < 0)
+  {
+    // a bad record ends the session; no recv is posted after it
+    InterlockedExchange(&conn->recv_failed, 1);
+    tsprintf("Server: TLS receive failed on socket %d\n", conn->socket);
+    return false;
+  }
+  return true;
 }
 
 static void __stdcall server_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
 {
+  PROFILE_SCOPE(PROFILE_HANDLER);
+
   iocp_info_t* info = (iocp_info_t*)overlapped;
+  connection_t* conn = info->connection;
+
+  if (conn != NULL)
+  {
+    numa_note_completion(conn->home_node);
+  }
+
   switch (info->kind)
   {
   case iocp_info_kind_t::IOCP_KIND_ACCEPT:
-    if (errorCode == ERROR_SUCCESS && complete_accept(info->socket))
+    if (errorCode != ERROR_SUCCESS)
+    {
+      report_completion_error("Server", "accept", info->socket, overlapped, errorCode);
+      InterlockedExchange(&accept_failed, 1);
+    }
+    else if (complete_accept(info->socket))
     {
       if (!g_test_closed_connection)
       {
         g_client_can_connect = true;
       }
 
-      start_recv(info->socket);
+      start_recv(conn);
+    }
+    break;
+
+  case iocp_info_kind_t::IOCP_KIND_RECV:
+    if (errorCode == ERROR_SUCCESS)
+    {
+      int length = (int)numBytes;
+      if (numBytes == 0)
+      {
+        if (conn->tls == NULL)
+        {
+          print_read(conn, length);
+        }
+        InterlockedExchange(&conn->peer_closed, 1);
+      }
+      else if (conn->tls != NULL)
+      {
+        // decrypts in place; handshake records leave nothing for the handler
+        if (read_tls_plaintext(conn, tls_recv(conn->tls, conn->read_buffer, numBytes, READ_BUFFER_SIZE - 1)))
+        {
+          start_recv(conn);
+        }
+      }
+      else
+      {
+        capture_read(conn, length);
+
+        if (g_test_echo)
+        {
+          // the next recv is posted once the echo has gone out
+          start_echo(conn, length);
+          break;
+        }
+
+        print_read(conn, length);
+        start_recv(conn);
+      }
     }
     else
     {
-      tsprintf("Server: accept failed for %d with error %x:\n", info->socket, errorCode);
-      print_wsa_error(info->socket, overlapped);
+      InterlockedExchange(&conn->recv_failed, 1);
+      report_completion_error("Server", "recv", info->socket, overlapped, errorCode);
     }
     break;
 
-  case iocp_info_kind_t::IOCP_KIND_RECV:
-    if (errorCode == ERROR_SUCCESS)
+  case iocp_info_kind_t::IOCP_KIND_SEND:
+    if (errorCode == ERROR_SUCCESS && conn->send_offset + numBytes < conn->send_length)
     {
-      memset(print_buffer, 0, READ_BUFFER_SIZE - 1);
-      memcpy(print_buffer, read_buffer, numBytes);
+      // a short send keeps the connection's send slot until the rest is out
+      conn->send_offset += numBytes;
+      post_send(conn);
+      break;
+    }
 
-      tsprintf("Server: read %d bytes: '%s'\n", numBytes, print_buffer);
+    if (conn->send_command != NULL)
+    {
+      // a plaintext send command; neither the echo nor the TLS stage waits on it
+      free(conn->send_command);
+      conn->send_command = NULL;
+      InterlockedExchange(&conn->sending, 0);
+      if (errorCode != ERROR_SUCCESS)
+      {
+        report_completion_error("Server", "send", info->socket, overlapped, errorCode);
+      }
+      break;
+    }
 
-      if (numBytes > 0)
+    InterlockedExchange(&conn->sending, 0);
+    if (errorCode != ERROR_SUCCESS)
+    {
+      report_completion_error("Server", "send", info->socket, overlapped, errorCode);
+    }
+    else if (g_test_echo && conn->tls == NULL)
+    {
+      start_recv(conn);
+    }
+    else if (conn->echo_backlog > 0)
+    {
+      start_send(conn);
+      if (tls_queue(conn->tls, conn->read_buffer, conn->echo_backlog))
       {
-        start_recv(info->socket);
+        // the session may still hold plaintext the backlogged recv decrypted
+        conn->echo_backlog = 0;
+        if (read_tls_plaintext(conn, tls_recv(conn->tls, conn->read_buffer, 0, READ_BUFFER_SIZE - 1)))
+        {
+          start_recv(conn);
+        }
       }
     }
     else
     {
-      tsprintf("Server: recv failed for %d with error %x:\n", info->socket, errorCode);
-      print_wsa_error(info->socket, overlapped);
+      start_send(conn);
     }
     break;
 
@@ -121,8 +379,7 @@ static void __stdcall server_completion_routine(DWORD errorCode, DWORD numBytes,
     }
     else
     {
-      tsprintf("Server: disconnect for %d failed with error %x:\n", info->socket, errorCode);
-      print_wsa_error(info->socket, overlapped);
+      report_completion_error("Server", "disconnect", info->socket, overlapped, errorCode);
     }
     break;
 
@@ -130,7 +387,15 @@ static void __stdcall server_completion_routine(DWORD errorCode, DWORD numBytes,
     break;
   }
 
-  free(info);
+  if (conn != NULL)
+  {
+    release_connection(conn);
+  }
+  else
+  {
+    PROFILE_SCOPE(PROFILE_FREE);
+    free(info);
+  }
 }
 
 bool create_listen_socket()
@@ -164,7 +429,7 @@ bool create_listen_socket()
     return false;
   }
 
-  if (!BindIoCompletionCallback((HANDLE)listen_socket, server_completion_routine, 0))
+  if (!BIND_COMPLETION(listen_socket, server_completion_routine))
   {
     tsprintf("Server: unable to bind io completion for listen_socket:\n");
     printwindowserror(GetLastError());
@@ -238,20 +503,32 @@ static bool start_accept()
     return false;
   }
 
-  if (BindIoCompletionCallback((HANDLE)new_socket, server_completion_routine, 0) == 0)
+  if (BIND_COMPLETION(new_socket, server_completion_routine) == 0)
   {
     tsprintf("Server: ERROR binding IO completion callback\n");
     printwindowserror(GetLastError());
+    closesocket(new_socket);
+    new_socket = INVALID_SOCKET;
     return false;
   }
 
-  iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_ACCEPT, new_socket);
+  connection = create_connection(new_socket);
+  iocp_info_t* info = connection != NULL ? connection_iocp(connection, iocp_info_kind_t::IOCP_KIND_ACCEPT) : NULL;
   if (info == NULL)
   {
     tsprintf("Server: out of memory\n");
+    if (connection != NULL)
+    {
+      release_connection(connection);
+      connection = NULL;
+    }
+    closesocket(new_socket);
+    new_socket = INVALID_SOCKET;
     return false;
   }
 
+  PROFILE_SCOPE(PROFILE_POST);
+
   DWORD bytes;
   if (g_AcceptEx(listen_socket, new_socket, info->buf, 0, IOCP_ACCEPT_ADDR_LEN, IOCP_ACCEPT_ADDR_LEN, &bytes, &info->ov))
   {
@@ -273,7 +550,13 @@ static bool start_accept()
     {
       tsprintf("Server: ERROR accepting:\n");
       printwindowserror(err);
-      free(info);
+
+      // the accept's reference, then the server's
+      release_connection(connection);
+      release_connection(connection);
+      connection = NULL;
+      closesocket(new_socket);
+      new_socket = INVALID_SOCKET;
       return false;
     }
   }
@@ -291,6 +574,11 @@ static bool complete_accept(SOCKET s)
 
     if (setsockopt(s, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char*)&listen_socket, sizeof(SOCKET)) == 0)
     {
+      if (g_use_tls && connection != NULL)
+      {
+        connection->tls = tls_create(true);
+      }
+
       accepted_socket = s;
       accepting = false;
 
@@ -306,29 +594,110 @@ static bool complete_accept(SOCKET s)
   return false;
 }
 
-static bool start_recv(SOCKET s)
+static bool start_recv(connection_t* conn)
 {
-  iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_RECV, s);
+  PROFILE_SCOPE(PROFILE_POST);
+
+  iocp_info_t* info = connection_iocp(conn, iocp_info_kind_t::IOCP_KIND_RECV, &conn->recv_info);
+  if (info == NULL)
+  {
+    tsprintf("Server: out of memory\n");
+    return false;
+  }
 
   WSABUF buf;
-  buf.buf = read_buffer;
-  buf.len = READ_BUFFER_SIZE;
+  buf.buf = conn->read_buffer;
+  buf.len = fault_post_length(info->fault_key, READ_BUFFER_SIZE);
   DWORD bytesReceived;
   DWORD flags = 0;
 
-  if (WSARecv(s, &buf, 1, &bytesReceived, &flags, (LPWSAOVERLAPPED)info, NULL) != 0)
+  if (WSARecv(conn->socket, &buf, 1, &bytesReceived, &flags, (LPWSAOVERLAPPED)info, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    if (error != WSA_IO_PENDING)
+    {
+      report_error("Server", "start recv", error);
+      release_connection(conn);
+      return false;
+    }
+  }
+  return true;
+}
+
+// posts conn->send_buffer, or the send command's data, from send_offset to
+// send_length; the caller has set conn->sending, and the completion reposts
+// whatever a short send left
+static bool post_send(connection_t* conn)
+{
+  iocp_info_t* info = connection_iocp(conn, iocp_info_kind_t::IOCP_KIND_SEND, &conn->send_info);
+  if (info == NULL)
   {
-    DWORD error = GetLastError();
+    tsprintf("Server: out of memory\n");
+    free(conn->send_command);
+    conn->send_command = NULL;
+    InterlockedExchange(&conn->sending, 0);
+    return false;
+  }
+
+  char* data = conn->send_command != NULL ? conn->send_command->data : conn->send_buffer;
+
+  WSABUF buf;
+  buf.buf = data + conn->send_offset;
+  buf.len = fault_post_length(info->fault_key, (ULONG)(conn->send_length - conn->send_offset));
+  DWORD bytesSent;
+
+  if (WSASend(conn->socket, &buf, 1, &bytesSent, 0, (LPWSAOVERLAPPED)info, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
     if (error != WSA_IO_PENDING)
     {
-      tsprintf("Server: unable to start Recv:\n");
-      printwindowserror(error);
+      report_error("Server", "start send", error);
+      free(conn->send_command);
+      conn->send_command = NULL;
+      InterlockedExchange(&conn->sending, 0);
+      release_connection(conn);
       return false;
     }
   }
   return true;
 }
 
+// sends whatever the TLS stage has ready; only one send is in flight at a time
+static bool start_send(connection_t* conn)
+{
+  PROFILE_SCOPE(PROFILE_POST);
+
+  if (conn->tls == NULL || InterlockedCompareExchange(&conn->sending, 1, 0) != 0)
+  {
+    return true;
+  }
+
+  size_t len = tls_take_output(conn->tls, conn->send_buffer, TLS_BUFFER_SIZE);
+  if (len == 0)
+  {
+    InterlockedExchange(&conn->sending, 0);
+    return true;
+  }
+
+  conn->send_offset = 0;
+  conn->send_length = len;
+  return post_send(conn);
+}
+
+// sends back what the last recv read; no recv is posted until it completes, so
+// the send buffer is never overwritten while in flight, and server_command()
+// rejects plaintext sends in the echo test so nothing else takes the slot
+static bool start_echo(connection_t* conn, int length)
+{
+  PROFILE_SCOPE(PROFILE_POST);
+
+  InterlockedExchange(&conn->sending, 1);
+  memcpy(conn->send_buffer, conn->read_buffer, length);
+  conn->send_offset = 0;
+  conn->send_length = (size_t)length;
+  return post_send(conn);
+}
+
 static void set_no_linger(SOCKET s)
 {
   LINGER linger_opt;
@@ -343,14 +712,53 @@ static void close_socket(SOCKET s)
   CancelIoEx((HANDLE)s, NULL);
 }
 
-static DWORD close_sockets()
+// disconnects accepted_socket and drops the server's reference on its connection;
+// with fault injection on, the socket is closed with a seeded FIN or RST instead
+static void close_connection()
 {
-  DWORD return_value = EXIT_SUCCESS;
+  if (accepted_socket != INVALID_SOCKET && connection != NULL && g_fault.enabled)
+  {
+    fault_close_socket(accepted_socket, fault_key(connection->fault_stream, SERVER_FAULT_CLOSE, 0));
+    accepted_socket = INVALID_SOCKET;
+  }
+  else if (accepted_socket != INVALID_SOCKET && connection != NULL)
+  {
+    iocp_info_t* info = connection_iocp(connection, iocp_info_kind_t::IOCP_KIND_DISCONNECT);
+    if (info == NULL)
+    {
+      tsprintf("Server: out of memory\n");
+    }
+    else if (g_DisconnectEx(accepted_socket, (LPOVERLAPPED)info, TF_REUSE_SOCKET, 0))
+    {
+      tsprintf("Server: accepted_socket %d disconnected\n", accepted_socket);
+    }
+    else
+    {
+      DWORD error = WSAGetLastError();
+      if (error != ERROR_IO_PENDING)
+      {
+        tsprintf("Server: disconnect for accepted_socket %d failed:\n", accepted_socket);
+        printwindowserror(error);
+        release_connection(connection);
+      }
+    }
+    accepted_socket = INVALID_SOCKET;
+  }
 
-  if (listen_socket != INVALID_SOCKET)
+  // the arena goes once the last operation on the connection completes
+  if (connection != NULL)
   {
-    iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_DISCONNECT, listen_socket);
+    connection_t* conn = connection;
+    connection = NULL;
+    release_connection(conn);
+  }
+}
 
+// closes the listener and cancels any pending accept
+static void stop_accepting()
+{
+  if (listen_socket != INVALID_SOCKET)
+  {
     if (CancelIoEx((HANDLE)listen_socket, NULL))
     {
       tsprintf("Server: listen_socket %d IO canceled\n", listen_socket);
@@ -393,34 +801,255 @@ static DWORD close_sockets()
         printwindowserror(error);
       }
     }
+    fault_close_socket(new_socket, connection != NULL ? fault_key(connection->fault_stream, SERVER_FAULT_CLOSE, 0) : 0);
+    new_socket = INVALID_SOCKET;
+  }
+  accepting = false;
+}
+
+// closes the socket of a failed accept and drops the server's reference on its
+// connection, so the server loop posts a fresh accept
+static void abandon_accept()
+{
+  InterlockedExchange(&accept_failed, 0);
+
+  if (new_socket != INVALID_SOCKET)
+  {
+    tsprintf("Server: abandoning failed accept socket %d\n", new_socket);
     closesocket(new_socket);
     new_socket = INVALID_SOCKET;
   }
 
-  if (accepted_socket != INVALID_SOCKET)
+  if (connection != NULL)
+  {
+    connection_t* conn = connection;
+    connection = NULL;
+    release_connection(conn);
+  }
+  accepting = false;
+}
+
+static DWORD close_sockets()
+{
+  DWORD return_value = EXIT_SUCCESS;
+
+  stop_accepting();
+  close_connection();
+
+  return return_value;
+}
+
+constexpr DWORD DRAIN_POLL_MS = 10;
+constexpr DWORD DRAIN_CANCEL_WAIT_MS = 1000;
+
+// flushes the connection's sends, half-closes it so the client sees our FIN, then
+// waits until the deadline for the client's FIN; a connection that does not get
+// that far is reset
+static void drain_one(connection_t* conn, ULONGLONG deadline)
+{
+  SOCKET s = conn->socket;
+
+  while (GetTickCount64() < deadline && !conn->recv_failed)
   {
-    iocp_info_t* info = alloc_iocp(iocp_info_kind_t::IOCP_KIND_DISCONNECT, accepted_socket);
-    if (g_DisconnectEx(accepted_socket, (LPOVERLAPPED)info, TF_REUSE_SOCKET, 0))
+    // pushes out anything the TLS stage still has queued
+    start_send(conn);
+    if (conn->sending == 0)
     {
-      tsprintf("Server: accepted_socket %d disconnected\n");
+      break;
+    }
+    SleepEx(DRAIN_POLL_MS, true);
+  }
+
+  bool half_closed = conn->sending == 0 && !conn->recv_failed && shutdown(s, SD_SEND) == 0;
+
+  while (half_closed && GetTickCount64() < deadline && !conn->peer_closed && !conn->recv_failed)
+  {
+    SleepEx(DRAIN_POLL_MS, true);
+  }
+
+  if (half_closed && conn->peer_closed)
+  {
+    tsprintf("Server: connection on socket %d drained\n", s);
+    connections_drained++;
+  }
+  else
+  {
+    tsprintf("Server: resetting connection on socket %d at the drain deadline\n", s);
+    set_no_linger(s);
+    connections_reset++;
+  }
+  closesocket(s);
+}
+
+// stops accepting, then gives every open connection until the deadline to flush
+// its sends and see the client's FIN; one that has not by then is reset
+static void drain_connection()
+{
+  stop_accepting();
+
+  ULONGLONG deadline = GetTickCount64() + g_drain_timeout_ms;
+
+  if (connection != NULL && accepted_socket != INVALID_SOCKET)
+  {
+    drain_one(connection, deadline);
+    accepted_socket = INVALID_SOCKET;
+  }
+
+  for (int i = 0; i < parked_count; i++)
+  {
+    drain_one(parked_connections[i], deadline);
+    release_connection(parked_connections[i]);
+  }
+  parked_count = 0;
+
+  // drops the server's reference; cancelled operations drop theirs as they complete
+  close_connection();
+
+  deadline = GetTickCount64() + DRAIN_CANCEL_WAIT_MS;
+  while (connections_live > 0 && GetTickCount64() < deadline)
+  {
+    SleepEx(DRAIN_POLL_MS, true);
+  }
+
+  if (connections_reaped > 0)
+  {
+    tsprintf("Server: %d closed connections reaped before the drain\n", connections_reaped);
+  }
+  tsprintf("Server: drain: %d connections drained, %d reset\n", connections_drained, connections_reset);
+  if (connections_live > 0)
+  {
+    tsprintf("Server: %d connections still have operations outstanding\n", connections_live);
+  }
+}
+
+// closes parked connections whose client has gone, gracefully once their sends are
+// done if it closed, or with a reset if the recv failed, and compacts the table so
+// accepting carries on past SERVER_MAX_CONNECTIONS in a long run
+static void reap_parked_connections()
+{
+  int kept = 0;
+  for (int i = 0; i < parked_count; i++)
+  {
+    connection_t* conn = parked_connections[i];
+    bool failed = conn->recv_failed != 0;
+
+    if (!failed && !(conn->peer_closed && conn->sending == 0))
+    {
+      parked_connections[kept++] = conn;
+      continue;
+    }
+
+    if (g_fault.enabled)
+    {
+      fault_close_socket(conn->socket, fault_key(conn->fault_stream, SERVER_FAULT_CLOSE, 0));
     }
     else
     {
-      DWORD error = WSAGetLastError();
-      if (error != ERROR_IO_PENDING)
+      if (failed)
       {
-        tsprintf("Server: disconnect for accepted_socket %d failed:\n", accepted_socket);
-        printwindowserror(error);
+        set_no_linger(conn->socket);
+      }
+      else
+      {
+        shutdown(conn->socket, SD_SEND);
       }
+      closesocket(conn->socket);
     }
-    accepted_socket = INVALID_SOCKET;
+
+    connections_reaped++;
+    release_connection(conn);
   }
+  parked_count = kept;
+}
 
-  return return_value;
+// the connection a command addresses: INVALID_SOCKET means the current one,
+// otherwise the current or a parked connection on that socket
+static connection_t* command_connection(SOCKET s)
+{
+  if (connection != NULL && accepted_socket != INVALID_SOCKET && (s == INVALID_SOCKET || s == accepted_socket))
+  {
+    return connection;
+  }
+
+  for (int i = 0; s != INVALID_SOCKET && i < parked_count; i++)
+  {
+    if (parked_connections[i]->socket == s)
+    {
+      return parked_connections[i];
+    }
+  }
+  return NULL;
+}
+
+// runs on the server thread, woken out of SleepEx by command_post()
+static bool server_command(command_queue_t* queue, command_t* command)
+{
+  connection_t* conn = NULL;
+
+  switch (command->kind)
+  {
+  case command_kind_t::COMMAND_CLOSE:
+    if (accepted_socket != INVALID_SOCKET && (command->socket == INVALID_SOCKET || command->socket == accepted_socket))
+    {
+      tsprintf("Server: closing connection on socket %d by request\n", accepted_socket);
+      close_connection();
+    }
+    else
+    {
+      command_reject(queue, command, "no such connection");
+    }
+    break;
+
+  case command_kind_t::COMMAND_SEND:
+    conn = command_connection(command->socket);
+    if (conn == NULL)
+    {
+      command_reject(queue, command, "no such connection");
+    }
+    else if (conn->tls != NULL)
+    {
+      if (command->len > TLS_RECORD_MAX || !tls_queue(conn->tls, command->data, command->len))
+      {
+        command_reject(queue, command, "TLS stage full");
+      }
+      start_send(conn);
+    }
+    else if (g_test_echo)
+    {
+      // the plaintext echo owns send_info and the send slot between its recvs
+      command_reject(queue, command, "the echo test owns the send slot");
+    }
+    else if (InterlockedCompareExchange(&conn->sending, 1, 0) != 0)
+    {
+      command_reject(queue, command, "a send is already in flight");
+    }
+    else
+    {
+      // plaintext goes out straight from the command, which the send completion frees
+      conn->send_command = command;
+      conn->send_offset = 0;
+      conn->send_length = command->len;
+      post_send(conn);
+      return false;
+    }
+    break;
+
+  default:
+    // COMMAND_SHUTDOWN only needs the wakeup; the loop re-checks g_running
+    break;
+  }
+
+  return true;
 }
 
 DWORD WINAPI ServerThread(LPVOID data)
 {
+  server_node = numa_bind_thread(0);
+  if (server_node != NUMA_NODE_NONE)
+  {
+    numa_pool_init(&connection_pool, "Server", server_node, sizeof(arena_t) + connection_arena_size(g_use_tls || g_test_echo), CONNECTION_POOL_BLOCKS);
+  }
+
   // create listen socket
   if (!create_listen_socket())
   {
@@ -429,6 +1058,8 @@ DWORD WINAPI ServerThread(LPVOID data)
     return EXIT_FAILURE;
   }
 
+  command_queue_attach(&g_serverCommands, server_command);
+
   //
   tsprintf("Server: running...\n");
   DWORD return_value = EXIT_SUCCESS;
@@ -437,6 +1068,26 @@ DWORD WINAPI ServerThread(LPVOID data)
   {
     if (listen_socket != INVALID_SOCKET)
     {
+      if (g_server_accept_many)
+      {
+        reap_parked_connections();
+      }
+
+      // keeps the accepted connection open and frees the slot for the next accept
+      if (g_server_accept_many && !accepting && accepted_socket != INVALID_SOCKET && parked_count < SERVER_MAX_CONNECTIONS)
+      {
+        parked_connections[parked_count++] = connection;
+        connection = NULL;
+        accepted_socket = INVALID_SOCKET;
+      }
+
+      // the closed-connection test closes everything once the accept is over, so
+      // only the other modes need a new accept after a failed one
+      if (accept_failed && !g_test_closed_connection)
+      {
+        abandon_accept();
+      }
+
       if (!accepting && accepted_socket == INVALID_SOCKET)
       {
         if (start_accept())
@@ -460,8 +1111,23 @@ DWORD WINAPI ServerThread(LPVOID data)
   }
 
   // clean up
+  command_queue_detach(&g_serverCommands);
+  drain_connection();
   return_value = close_sockets();
 
+  if (connections_released > 0)
+  {
+    tsprintf("Server: %d connections released; %lld arena bytes on average, %d peak\n",
+      connections_released, connection_bytes_total / connections_released, connection_bytes_peak);
+  }
+
+  // a connection that outlived the drain still points into the pool
+  print_numa_pool_stats(&connection_pool);
+  if (connections_live == 0)
+  {
+    numa_pool_destroy(&connection_pool);
+  }
+
   if (return_value == EXIT_SUCCESS)
   {
     tsprintf("Server: exiting successfully\n");
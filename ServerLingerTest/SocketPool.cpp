@@ -0,0 +1,199 @@
+#include "pch.h"
+#include "Numa.h"
+#include "Poll.h"
+#include "SocketPool.h"
+
+extern int tsprintf(const char* format, ...);
+
+extern bool g_running;
+
+static SRWLOCK endpoint_lock = SRWLOCK_INIT;
+static char endpoint_host[NI_MAXHOST];
+static char endpoint_port[NI_MAXSERV];
+static struct sockaddr_storage endpoint_addr;
+static int endpoint_addr_len = 0;
+
+bool resolve_endpoint(const char* host, const char* port, struct sockaddr_storage* addr, int* addr_len)
+{
+  bool found = false;
+
+  AcquireSRWLockShared(&endpoint_lock);
+  if (endpoint_addr_len > 0 && strcmp(endpoint_host, host) == 0 && strcmp(endpoint_port, port) == 0)
+  {
+    memcpy(addr, &endpoint_addr, endpoint_addr_len);
+    *addr_len = endpoint_addr_len;
+    found = true;
+  }
+  ReleaseSRWLockShared(&endpoint_lock);
+
+  if (found)
+  {
+    return true;
+  }
+
+  struct addrinfo hints = { 0 };
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  struct addrinfo* result = NULL;
+  if (getaddrinfo(host, port, &hints, &result) != 0 || result == NULL)
+  {
+    return false;
+  }
+
+  AcquireSRWLockExclusive(&endpoint_lock);
+  strcpy_s(endpoint_host, NI_MAXHOST, host);
+  strcpy_s(endpoint_port, NI_MAXSERV, port);
+  memcpy(&endpoint_addr, result->ai_addr, result->ai_addrlen);
+  endpoint_addr_len = (int)result->ai_addrlen;
+  ReleaseSRWLockExclusive(&endpoint_lock);
+
+  memcpy(addr, result->ai_addr, result->ai_addrlen);
+  *addr_len = (int)result->ai_addrlen;
+
+  freeaddrinfo(result);
+  return true;
+}
+
+// leaves the WSA error set on failure
+static SOCKET create_pooled_socket(socket_pool_t* pool)
+{
+  SOCKET s = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+  if (s == INVALID_SOCKET)
+  {
+    return INVALID_SOCKET;
+  }
+
+  if (!bind_completion_on_node((HANDLE)s, pool->routine, pool->node))
+  {
+    DWORD error = GetLastError();
+    closesocket(s);
+    WSASetLastError(error);
+    return INVALID_SOCKET;
+  }
+
+  struct sockaddr_storage addr = { 0 };
+  addr.ss_family = AF_INET;
+  if (bind(s, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    closesocket(s);
+    WSASetLastError(error);
+    return INVALID_SOCKET;
+  }
+
+  return s;
+}
+
+static DWORD WINAPI refill_socket_pool(LPVOID data)
+{
+  socket_pool_t* pool = (socket_pool_t*)data;
+
+  while (g_running)
+  {
+    AcquireSRWLockShared(&pool->lock);
+    bool full = pool->count >= pool->target;
+    ReleaseSRWLockShared(&pool->lock);
+
+    if (full)
+    {
+      break;
+    }
+
+    SOCKET s = create_pooled_socket(pool);
+    if (s == INVALID_SOCKET)
+    {
+      // out of sockets or ephemeral ports; acquire() will try again later
+      break;
+    }
+
+    AcquireSRWLockExclusive(&pool->lock);
+    if (pool->count < pool->target)
+    {
+      pool->sockets[pool->count++] = s;
+      s = INVALID_SOCKET;
+    }
+    ReleaseSRWLockExclusive(&pool->lock);
+
+    if (s != INVALID_SOCKET)
+    {
+      closesocket(s);
+      break;
+    }
+  }
+
+  InterlockedExchange(&pool->refilling, 0);
+  return 0;
+}
+
+static void schedule_refill(socket_pool_t* pool)
+{
+  if (InterlockedCompareExchange(&pool->refilling, 1, 0) == 0)
+  {
+    if (!QueueUserWorkItem(refill_socket_pool, pool, WT_EXECUTEDEFAULT))
+    {
+      InterlockedExchange(&pool->refilling, 0);
+    }
+  }
+}
+
+void socket_pool_init(socket_pool_t* pool, const char* name, LPOVERLAPPED_COMPLETION_ROUTINE routine, int target)
+{
+  pool->name = name;
+  pool->routine = routine;
+  pool->node = numa_current_node();
+  pool->target = min(target, SOCKET_POOL_MAX);
+  InitializeSRWLock(&pool->lock);
+  pool->count = 0;
+  pool->refilling = 0;
+  pool->hits = 0;
+  pool->misses = 0;
+
+  schedule_refill(pool);
+}
+
+void socket_pool_destroy(socket_pool_t* pool)
+{
+  // wait for a running refill so no socket is added behind our back
+  while (InterlockedCompareExchange(&pool->refilling, 1, 0) != 0)
+  {
+    Sleep(1);
+  }
+
+  AcquireSRWLockExclusive(&pool->lock);
+  for (int i = 0; i < pool->count; i++)
+  {
+    closesocket(pool->sockets[i]);
+  }
+  pool->count = 0;
+  ReleaseSRWLockExclusive(&pool->lock);
+}
+
+SOCKET socket_pool_acquire(socket_pool_t* pool)
+{
+  SOCKET s = INVALID_SOCKET;
+
+  AcquireSRWLockExclusive(&pool->lock);
+  if (pool->count > 0)
+  {
+    s = pool->sockets[--pool->count];
+  }
+  ReleaseSRWLockExclusive(&pool->lock);
+
+  schedule_refill(pool);
+
+  if (s != INVALID_SOCKET)
+  {
+    InterlockedIncrement64(&pool->hits);
+    return s;
+  }
+
+  InterlockedIncrement64(&pool->misses);
+  return create_pooled_socket(pool);
+}
+
+void print_socket_pool_stats(socket_pool_t* pool)
+{
+  tsprintf("%s: socket pool %lld hits, %lld misses\n", pool->name, pool->hits, pool->misses);
+}
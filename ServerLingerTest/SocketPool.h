@@ -0,0 +1,33 @@
+#ifndef SERVER_LINGER_TEST_SOCKET_POOL_H
+#define SERVER_LINGER_TEST_SOCKET_POOL_H
+
+// client sockets that are already created, bound to an ephemeral port and bound to
+// their completion routine, so a connect only costs the ConnectEx call
+constexpr int SOCKET_POOL_MAX = 256;
+
+typedef struct socket_pool_t
+{
+  const char* name;
+  LPOVERLAPPED_COMPLETION_ROUTINE routine;
+  USHORT node;  // the owner's node; refills run on other threads
+  int target;
+  SRWLOCK lock;
+  SOCKET sockets[SOCKET_POOL_MAX];
+  int count;
+  volatile LONG refilling;
+  volatile LONG64 hits;
+  volatile LONG64 misses;
+} socket_pool_t;
+
+// the pool's sockets go to the busy-poll port of the calling thread's node
+extern void socket_pool_init(socket_pool_t* pool, const char* name, LPOVERLAPPED_COMPLETION_ROUTINE routine, int target);
+extern void socket_pool_destroy(socket_pool_t* pool);
+
+// returns a pooled socket, or a new one if the pool is empty; refills in the background
+extern SOCKET socket_pool_acquire(socket_pool_t* pool);
+extern void print_socket_pool_stats(socket_pool_t* pool);
+
+// resolves host:port once and answers from the cache until the port changes
+extern bool resolve_endpoint(const char* host, const char* port, struct sockaddr_storage* addr, int* addr_len);
+
+#endif
@@ -0,0 +1,425 @@
+#include "pch.h"
+#include "Tls.h"
+
+extern int tsprintf(const char* format, ...);
+
+#ifdef SLT_WITH_OPENSSL
+
+// add the include and library directories of the local OpenSSL build to the project
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#pragma comment(lib, "libssl.lib")
+#pragma comment(lib, "libcrypto.lib")
+
+struct tls_session_t
+{
+  SSL* ssl;
+  BIO* rbio;
+  BIO* wbio;
+  bool server;
+  bool handshake_done;
+  CRITICAL_SECTION lock;
+  volatile LONG refs;
+  size_t queued;
+  char plaintext[TLS_RECORD_MAX];
+};
+
+static SSL_CTX* server_ctx = NULL;
+static SSL_CTX* client_ctx = NULL;
+
+static DWORD tls_start_ticks = 0;
+static volatile LONG64 tls_handshakes = 0;
+static volatile LONG64 tls_bytes_in = 0;
+static volatile LONG64 tls_bytes_out = 0;
+static volatile LONG64 tls_writes = 0;
+static volatile LONG64 tls_records = 0;
+
+static void print_ssl_errors(const char* what)
+{
+  tsprintf("TLS: %s failed:\n", what);
+
+  unsigned long err;
+  char buffer[256];
+  while ((err = ERR_get_error()) != 0)
+  {
+    ERR_error_string_n(err, buffer, sizeof(buffer));
+    tsprintf("  %s\n", buffer);
+  }
+}
+
+// the experiment has no PKI; the server presents a throwaway self-signed certificate
+static bool use_self_signed_certificate(SSL_CTX* ctx)
+{
+  EVP_PKEY* pkey = EVP_EC_gen("P-256");
+  X509* cert = X509_new();
+  bool ok = false;
+
+  if (pkey != NULL && cert != NULL)
+  {
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, pkey);
+
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    ok = X509_sign(cert, pkey, EVP_sha256()) > 0
+      && SSL_CTX_use_certificate(ctx, cert) == 1
+      && SSL_CTX_use_PrivateKey(ctx, pkey) == 1;
+  }
+
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return ok;
+}
+
+bool tls_init()
+{
+  server_ctx = SSL_CTX_new(TLS_server_method());
+  client_ctx = SSL_CTX_new(TLS_client_method());
+  if (server_ctx == NULL || client_ctx == NULL)
+  {
+    print_ssl_errors("SSL_CTX_new");
+    tls_cleanup();
+    return false;
+  }
+
+  SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+
+  // no session tickets, so the server only writes during the handshake or in reply
+  SSL_CTX_set_num_tickets(server_ctx, 0);
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+  if (!use_self_signed_certificate(server_ctx))
+  {
+    print_ssl_errors("creating server certificate");
+    tls_cleanup();
+    return false;
+  }
+
+  tls_start_ticks = GetTickCount();
+  return true;
+}
+
+void tls_cleanup()
+{
+  SSL_CTX_free(server_ctx);
+  SSL_CTX_free(client_ctx);
+  server_ctx = client_ctx = NULL;
+}
+
+static bool tls_drive_handshake(tls_session_t* session)
+{
+  int result = SSL_do_handshake(session->ssl);
+  if (result == 1)
+  {
+    session->handshake_done = true;
+    if (session->server)
+      InterlockedIncrement64(&tls_handshakes);
+    return true;
+  }
+
+  int err = SSL_get_error(session->ssl, result);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return true;
+
+  print_ssl_errors("handshake");
+  return false;
+}
+
+tls_session_t* tls_create(bool server)
+{
+  tls_session_t* session = (tls_session_t*)malloc(sizeof(tls_session_t));
+  if (session == NULL)
+    return NULL;
+
+  session->ssl = SSL_new(server ? server_ctx : client_ctx);
+  session->rbio = BIO_new(BIO_s_mem());
+  session->wbio = BIO_new(BIO_s_mem());
+  session->server = server;
+  session->handshake_done = false;
+  session->refs = 1;
+  session->queued = 0;
+
+  if (session->ssl == NULL || session->rbio == NULL || session->wbio == NULL)
+  {
+    print_ssl_errors("creating session");
+    BIO_free(session->rbio);
+    BIO_free(session->wbio);
+    SSL_free(session->ssl);
+    free(session);
+    return NULL;
+  }
+
+  // the SSL owns both BIOs from here on
+  SSL_set_bio(session->ssl, session->rbio, session->wbio);
+  InitializeCriticalSection(&session->lock);
+
+  if (server)
+  {
+    SSL_set_accept_state(session->ssl);
+  }
+  else
+  {
+    // leaves the ClientHello in the write BIO
+    SSL_set_connect_state(session->ssl);
+    tls_drive_handshake(session);
+  }
+
+  return session;
+}
+
+tls_session_t* tls_retain(tls_session_t* session)
+{
+  if (session != NULL)
+  {
+    InterlockedIncrement(&session->refs);
+  }
+  return session;
+}
+
+void tls_destroy(tls_session_t* session)
+{
+  if (session != NULL && InterlockedDecrement(&session->refs) == 0)
+  {
+    SSL_free(session->ssl);
+    DeleteCriticalSection(&session->lock);
+    free(session);
+  }
+}
+
+bool tls_handshake_done(tls_session_t* session)
+{
+  return session->handshake_done;
+}
+
+int tls_recv(tls_session_t* session, char* buf, size_t len, size_t cap)
+{
+  int total = 0;
+
+  EnterCriticalSection(&session->lock);
+
+  // the memory BIO copies the ciphertext, so buf can be reused for plaintext
+  if (len > 0 && BIO_write(session->rbio, buf, (int)len) != (int)len)
+  {
+    total = -1;
+  }
+  else if (!session->handshake_done && !tls_drive_handshake(session))
+  {
+    total = -1;
+  }
+
+  // application data may follow the last handshake message in the same read
+  if (total == 0 && session->handshake_done)
+  {
+    while ((size_t)total < cap)
+    {
+      int result = SSL_read(session->ssl, buf + total, (int)(cap - total));
+      if (result <= 0)
+      {
+        int err = SSL_get_error(session->ssl, result);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_ZERO_RETURN)
+        {
+          print_ssl_errors("SSL_read");
+          total = -1;
+        }
+        break;
+      }
+      total += result;
+    }
+  }
+
+  LeaveCriticalSection(&session->lock);
+
+  if (total > 0)
+    InterlockedAdd64(&tls_bytes_in, total);
+  return total;
+}
+
+bool tls_queue(tls_session_t* session, const char* data, size_t len)
+{
+  bool queued = false;
+
+  EnterCriticalSection(&session->lock);
+  if (session->queued + len <= TLS_RECORD_MAX)
+  {
+    memcpy(session->plaintext + session->queued, data, len);
+    session->queued += len;
+    queued = true;
+  }
+  LeaveCriticalSection(&session->lock);
+
+  if (queued)
+    InterlockedIncrement64(&tls_writes);
+  return queued;
+}
+
+size_t tls_take_output(tls_session_t* session, char* out, size_t cap)
+{
+  EnterCriticalSection(&session->lock);
+
+  // everything queued since the last flush goes out as a single record
+  if (session->handshake_done && session->queued > 0)
+  {
+    if (SSL_write(session->ssl, session->plaintext, (int)session->queued) > 0)
+    {
+      InterlockedAdd64(&tls_bytes_out, session->queued);
+      InterlockedIncrement64(&tls_records);
+    }
+    else
+    {
+      print_ssl_errors("SSL_write");
+    }
+    session->queued = 0;
+  }
+
+  int result = BIO_read(session->wbio, out, (int)cap);
+
+  LeaveCriticalSection(&session->lock);
+  return result > 0 ? (size_t)result : 0;
+}
+
+// moves whatever from has written over to to; false if to rejects it
+static bool tls_bench_exchange(tls_session_t* from, tls_session_t* to, char* buf, bool* moved)
+{
+  size_t len;
+  while ((len = tls_take_output(from, buf, TLS_BUFFER_SIZE)) > 0)
+  {
+    *moved = true;
+    if (tls_recv(to, buf, len, TLS_BUFFER_SIZE) < 0)
+      return false;
+  }
+  return true;
+}
+
+bool tls_bench_handshakes(DWORD ms)
+{
+  char* buf = (char*)malloc(TLS_BUFFER_SIZE);
+  if (buf == NULL)
+    return false;
+
+  LARGE_INTEGER frequency, start, now;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+  now = start;
+
+  FILETIME created, exited, kernel_start, user_start, kernel_end, user_end;
+  GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel_start, &user_start);
+
+  LONG64 count = 0;
+  bool ok = true;
+  while (ok && (now.QuadPart - start.QuadPart) * 1000 < (LONG64)ms * frequency.QuadPart)
+  {
+    // the client's ClientHello is already waiting when tls_create() returns
+    tls_session_t* client = tls_create(false);
+    tls_session_t* server = tls_create(true);
+    ok = client != NULL && server != NULL;
+
+    bool moved = true;
+    while (ok && moved && !(client->handshake_done && server->handshake_done))
+    {
+      moved = false;
+      ok = tls_bench_exchange(client, server, buf, &moved) && tls_bench_exchange(server, client, buf, &moved);
+    }
+
+    if (ok && client->handshake_done && server->handshake_done)
+    {
+      count++;
+    }
+    else
+    {
+      ok = false;
+    }
+
+    tls_destroy(client);
+    tls_destroy(server);
+    QueryPerformanceCounter(&now);
+  }
+
+  GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel_end, &user_end);
+  free(buf);
+
+  // the run's own handshake count starts from zero again
+  InterlockedAdd64(&tls_handshakes, -count);
+
+  ULARGE_INTEGER k0, u0, k1, u1;
+  k0.LowPart = kernel_start.dwLowDateTime;
+  k0.HighPart = kernel_start.dwHighDateTime;
+  u0.LowPart = user_start.dwLowDateTime;
+  u0.HighPart = user_start.dwHighDateTime;
+  k1.LowPart = kernel_end.dwLowDateTime;
+  k1.HighPart = kernel_end.dwHighDateTime;
+  u1.LowPart = user_end.dwLowDateTime;
+  u1.HighPart = user_end.dwHighDateTime;
+
+  double wall_secs = (now.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+  double cpu_secs = (k1.QuadPart - k0.QuadPart + u1.QuadPart - u0.QuadPart) / 1e7;
+  if (wall_secs <= 0.0)
+    wall_secs = 1e-3;
+  if (cpu_secs <= 0.0)
+    cpu_secs = 1e-3;
+
+  if (!ok)
+  {
+    tsprintf("TLS: handshake bench failed after %lld handshakes\n", count);
+    return false;
+  }
+
+  tsprintf("TLS: handshake bench: %lld client+server handshakes in %.3f s (%.1f/s, %.1f per cpu-second)\n",
+    count, wall_secs, count / wall_secs, count / cpu_secs);
+  return true;
+}
+
+void print_tls_stats()
+{
+  if (server_ctx == NULL)
+    return;
+
+  FILETIME created, exited, kernel, user;
+  GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+
+  double cpu_secs = (k.QuadPart + u.QuadPart) / 1e7;
+  double wall_secs = (GetTickCount() - tls_start_ticks) / 1000.0;
+  if (cpu_secs <= 0.0)
+    cpu_secs = 1e-3;
+  if (wall_secs <= 0.0)
+    wall_secs = 1e-3;
+
+  tsprintf("TLS: %lld handshakes (%.1f/s, %.1f per cpu-second)\n",
+    tls_handshakes, tls_handshakes / wall_secs, tls_handshakes / cpu_secs);
+  tsprintf("TLS: %lld bytes decrypted, %lld bytes encrypted (%.1f KB per cpu-second); %lld writes in %lld records\n",
+    tls_bytes_in, tls_bytes_out, (tls_bytes_in + tls_bytes_out) / 1024.0 / cpu_secs, tls_writes, tls_records);
+}
+
+#else
+
+bool tls_init()
+{
+  tsprintf("TLS: not available; build with SLT_WITH_OPENSSL and a local OpenSSL\n");
+  return false;
+}
+
+void tls_cleanup() {}
+tls_session_t* tls_create(bool server) { return NULL; }
+tls_session_t* tls_retain(tls_session_t* session) { return session; }
+void tls_destroy(tls_session_t* session) {}
+bool tls_handshake_done(tls_session_t* session) { return false; }
+int tls_recv(tls_session_t* session, char* buf, size_t len, size_t cap) { return -1; }
+bool tls_queue(tls_session_t* session, const char* data, size_t len) { return false; }
+size_t tls_take_output(tls_session_t* session, char* out, size_t cap) { return 0; }
+bool tls_bench_handshakes(DWORD ms) { return false; }
+void print_tls_stats() {}
+
+#endif
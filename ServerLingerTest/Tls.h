@@ -0,0 +1,36 @@
+#ifndef SERVER_LINGER_TEST_TLS_H
+#define SERVER_LINGER_TEST_TLS_H
+
+// optional TLS stage between the completion routines and the handlers; it needs a
+// locally built OpenSSL and SLT_WITH_OPENSSL defined, otherwise tls_init() fails
+constexpr size_t TLS_RECORD_MAX = 16384;
+constexpr size_t TLS_BUFFER_SIZE = TLS_RECORD_MAX + 512;
+
+typedef struct tls_session_t tls_session_t;
+
+extern bool tls_init();
+extern void tls_cleanup();
+
+// sessions are reference counted: tls_create() returns the first reference,
+// tls_retain() adds one for an operation that uses the session from another
+// thread, and tls_destroy() drops one; the session goes with the last
+extern tls_session_t* tls_create(bool server);
+extern tls_session_t* tls_retain(tls_session_t* session);
+extern void tls_destroy(tls_session_t* session);
+extern bool tls_handshake_done(tls_session_t* session);
+
+// feeds len bytes of ciphertext from buf and decrypts in place into buf (up to cap);
+// returns the plaintext length or -1 if the session failed
+extern int tls_recv(tls_session_t* session, char* buf, size_t len, size_t cap);
+
+// queues plaintext; queued writes are coalesced into one record by tls_take_output()
+extern bool tls_queue(tls_session_t* session, const char* data, size_t len);
+extern size_t tls_take_output(tls_session_t* session, char* out, size_t cap);
+
+// runs client/server handshakes back to back through memory for ms milliseconds,
+// without sockets, and reports the handshake rate of the TLS stage alone
+extern bool tls_bench_handshakes(DWORD ms);
+
+extern void print_tls_stats();
+
+#endif
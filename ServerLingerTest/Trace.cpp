@@ -0,0 +1,195 @@
+#include "pch.h"
+#include "Trace.h"
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+// records are written out in batches; completions only take the lock to append
+constexpr DWORD TRACE_BATCH = 4096;
+
+static SRWLOCK capture_lock = SRWLOCK_INIT;
+static HANDLE capture_file = INVALID_HANDLE_VALUE;
+static trace_record_t capture_batch[TRACE_BATCH];
+static DWORD capture_batched = 0;
+static trace_header_t capture_header;
+static LARGE_INTEGER capture_start;
+static LARGE_INTEGER capture_frequency;
+static volatile LONG capture_connections = 0;
+
+static bool write_all(HANDLE file, const void* data, DWORD len)
+{
+  DWORD written = 0;
+  return WriteFile(file, data, len, &written, NULL) && written == len;
+}
+
+bool trace_capture_open(const char* path)
+{
+  capture_file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (capture_file == INVALID_HANDLE_VALUE)
+  {
+    tsprintf("Trace: unable to create %s:\n", path);
+    printwindowserror(GetLastError());
+    return false;
+  }
+
+  memset(&capture_header, 0, sizeof(capture_header));
+  capture_header.magic = TRACE_MAGIC;
+  capture_header.version = TRACE_VERSION;
+  capture_header.record_size = sizeof(trace_record_t);
+
+  // rewritten with the counts when the capture closes
+  if (!write_all(capture_file, &capture_header, sizeof(capture_header)))
+  {
+    tsprintf("Trace: unable to write header to %s:\n", path);
+    printwindowserror(GetLastError());
+    CloseHandle(capture_file);
+    capture_file = INVALID_HANDLE_VALUE;
+    return false;
+  }
+
+  QueryPerformanceFrequency(&capture_frequency);
+  QueryPerformanceCounter(&capture_start);
+
+  tsprintf("Trace: capturing to %s\n", path);
+  return true;
+}
+
+bool trace_capturing()
+{
+  return capture_file != INVALID_HANDLE_VALUE;
+}
+
+UINT32 trace_capture_connection()
+{
+  return (UINT32)InterlockedIncrement(&capture_connections);
+}
+
+static void flush_batch()
+{
+  if (capture_batched > 0 && !write_all(capture_file, capture_batch, capture_batched * sizeof(trace_record_t)))
+  {
+    tsprintf("Trace: ERROR writing records; %d dropped\n", capture_batched);
+    capture_header.record_count -= capture_batched;
+  }
+  capture_batched = 0;
+}
+
+void trace_capture_record(UINT32 connection, UINT32 size)
+{
+  if (capture_file == INVALID_HANDLE_VALUE)
+  {
+    return;
+  }
+
+  AcquireSRWLockExclusive(&capture_lock);
+
+  // taken under the lock so offsets never go backwards in the file
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+
+  trace_record_t* record = &capture_batch[capture_batched++];
+  record->offset_us = (UINT64)((now.QuadPart - capture_start.QuadPart) * 1000000 / capture_frequency.QuadPart);
+  record->connection = connection;
+  record->size = size;
+
+  capture_header.record_count++;
+  capture_header.duration_us = record->offset_us;
+
+  if (capture_batched == TRACE_BATCH)
+  {
+    flush_batch();
+  }
+
+  ReleaseSRWLockExclusive(&capture_lock);
+}
+
+void trace_capture_close()
+{
+  if (capture_file == INVALID_HANDLE_VALUE)
+  {
+    return;
+  }
+
+  AcquireSRWLockExclusive(&capture_lock);
+  flush_batch();
+
+  capture_header.connection_count = (UINT32)capture_connections;
+
+  LARGE_INTEGER zero = { 0 };
+  if (!SetFilePointerEx(capture_file, zero, NULL, FILE_BEGIN) || !write_all(capture_file, &capture_header, sizeof(capture_header)))
+  {
+    tsprintf("Trace: ERROR rewriting header:\n");
+    printwindowserror(GetLastError());
+  }
+
+  CloseHandle(capture_file);
+  capture_file = INVALID_HANDLE_VALUE;
+  ReleaseSRWLockExclusive(&capture_lock);
+
+  tsprintf("Trace: captured %llu messages on %d connections over %.3f s\n", capture_header.record_count,
+    capture_header.connection_count, capture_header.duration_us / 1e6);
+}
+
+bool trace_map_open(trace_map_t* map, const char* path)
+{
+  memset(map, 0, sizeof(trace_map_t));
+
+  map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (map->file == INVALID_HANDLE_VALUE)
+  {
+    tsprintf("Trace: unable to open %s:\n", path);
+    printwindowserror(GetLastError());
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(map->file, &size) || size.QuadPart < (LONGLONG)sizeof(trace_header_t))
+  {
+    tsprintf("Trace: %s is too short for a trace\n", path);
+    trace_map_close(map);
+    return false;
+  }
+
+  map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  map->header = map->mapping != NULL ? (const trace_header_t*)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (map->header == NULL)
+  {
+    tsprintf("Trace: unable to map %s:\n", path);
+    printwindowserror(GetLastError());
+    trace_map_close(map);
+    return false;
+  }
+
+  // record_count comes from the file, so it is bounded by the size before it is
+  // multiplied; the records must then fill the rest of the file exactly
+  const trace_header_t* header = map->header;
+  UINT64 available = ((UINT64)size.QuadPart - sizeof(trace_header_t)) / sizeof(trace_record_t);
+  if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION
+    || header->record_size != sizeof(trace_record_t) || header->record_count > available
+    || (UINT64)size.QuadPart != sizeof(trace_header_t) + header->record_count * sizeof(trace_record_t))
+  {
+    tsprintf("Trace: %s is not a version %d trace or is truncated\n", path, TRACE_VERSION);
+    trace_map_close(map);
+    return false;
+  }
+
+  map->records = (const trace_record_t*)(header + 1);
+  return true;
+}
+
+void trace_map_close(trace_map_t* map)
+{
+  if (map->header != NULL)
+  {
+    UnmapViewOfFile(map->header);
+  }
+  if (map->mapping != NULL)
+  {
+    CloseHandle(map->mapping);
+  }
+  if (map->file != INVALID_HANDLE_VALUE && map->file != NULL)
+  {
+    CloseHandle(map->file);
+  }
+  memset(map, 0, sizeof(trace_map_t));
+}
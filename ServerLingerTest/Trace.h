@@ -0,0 +1,48 @@
+#ifndef SERVER_LINGER_TEST_TRACE_H
+#define SERVER_LINGER_TEST_TRACE_H
+
+// traffic traces: the server records each message it receives as a fixed-size
+// record, and the replay client maps the file and sends the same sizes on the
+// same schedule. The file is a header followed by records in time order.
+constexpr UINT32 TRACE_MAGIC = 0x52544c53;  // "SLTR"
+constexpr UINT32 TRACE_VERSION = 1;
+
+typedef struct trace_header_t
+{
+  UINT32 magic;
+  UINT32 version;
+  UINT32 record_size;
+  UINT32 connection_count;
+  UINT64 record_count;
+  UINT64 duration_us;
+} trace_header_t;
+
+// connection ids are dense, numbered from 1 in order of each connection's first message
+typedef struct trace_record_t
+{
+  UINT64 offset_us;
+  UINT32 connection;
+  UINT32 size;
+} trace_record_t;
+
+extern bool trace_capture_open(const char* path);
+extern void trace_capture_close();
+extern bool trace_capturing();
+
+// assigns the id for a connection's first message
+extern UINT32 trace_capture_connection();
+extern void trace_capture_record(UINT32 connection, UINT32 size);
+
+typedef struct trace_map_t
+{
+  HANDLE file;
+  HANDLE mapping;
+  const trace_header_t* header;
+  const trace_record_t* records;
+} trace_map_t;
+
+// maps a trace read-only and checks its header against the file size
+extern bool trace_map_open(trace_map_t* map, const char* path);
+extern void trace_map_close(trace_map_t* map);
+
+#endif
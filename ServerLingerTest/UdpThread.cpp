@@ -0,0 +1,428 @@
+#include "pch.h"
+#include "Arena.h"
+#include "Commands.h"
+#include "Errors.h"
+#include "Fault.h"
+#include "SocketPool.h"
+
+extern int tsprintf(const char* format, ...);
+extern void printwindowserror(int err);
+
+extern bool g_running;
+
+extern LPFN_WSARECVMSG g_WSARecvMsg;
+
+extern char* g_serverHost;
+extern char* g_serverPort;
+
+extern command_queue_t g_clientCommands;
+extern command_queue_t g_serverCommands;
+
+// datagram engine: the server keeps UDP_RECV_DEPTH WSARecvMsg calls posted and the
+// client keeps UDP_SEND_DEPTH sends in flight. Both go through the same completion
+// routine binding and fault layer as the TCP path. Their contexts and buffers
+// come from one arena per side rather than from connection_iocp(): there is no
+// connection to reference count, just one socket whose fixed set of contexts is
+// reposted until the socket closes.
+//
+// Windows has no recvmmsg/sendmmsg; the batching equivalents are UDP send offload
+// (UDP_SEND_MSG_SIZE: one send of UDP_SEND_BATCH segments) and receive coalescing
+// (UDP_RECV_MAX_COALESCED_SIZE: one completion for several datagrams). Both are
+// optional and fall back to one datagram per operation.
+constexpr int UDP_RECV_DEPTH = 32;
+constexpr int UDP_SEND_DEPTH = 32;
+constexpr int UDP_SEND_BATCH = 32;
+constexpr DWORD UDP_DATAGRAM_SIZE = 64;
+constexpr DWORD UDP_RECV_BUFFER_SIZE = 65536;
+constexpr DWORD UDP_SEND_BUFFER_SIZE = UDP_DATAGRAM_SIZE * UDP_SEND_BATCH;
+constexpr int UDP_SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+
+enum class udp_info_kind_t
+{
+  UDP_KIND_RECVFROM = 0,
+  UDP_KIND_SENDTO = 1
+};
+
+typedef struct udp_info_t
+{
+  OVERLAPPED ov;
+  unsigned long long fault_key;
+  udp_info_kind_t kind;
+  int index;
+  ULONG ops;
+  SOCKET socket;
+  WSAMSG msg;
+  WSABUF data;
+  struct sockaddr_storage from;
+  char control[WSA_CMSG_SPACE(sizeof(DWORD))];
+  char* buf;
+} udp_info_t;
+
+FAULT_KEYED(udp_info_t);
+
+static SOCKET udp_server_socket = INVALID_SOCKET;
+static SOCKET udp_client_socket = INVALID_SOCKET;
+static struct sockaddr_storage udp_server_addr;
+static int udp_server_addr_len = 0;
+
+static bool udp_send_offload = false;
+static bool udp_recv_coalescing = false;
+
+static volatile LONG udp_recvs_outstanding = 0;
+static volatile LONG udp_sends_outstanding = 0;
+static volatile LONG64 udp_datagrams_in = 0;
+static volatile LONG64 udp_bytes_in = 0;
+static volatile LONG64 udp_recv_completions = 0;
+static volatile LONG64 udp_datagrams_out = 0;
+static volatile LONG64 udp_send_completions = 0;
+
+static bool udp_start_recv(udp_info_t* info);
+static bool udp_start_send(udp_info_t* info);
+
+// a coalesced receive carries its segment size in a UDP_COALESCED_INFO control message
+static DWORD udp_datagram_count(udp_info_t* info, DWORD numBytes)
+{
+#ifdef UDP_COALESCED_INFO
+  for (WSACMSGHDR* cmsg = WSA_CMSG_FIRSTHDR(&info->msg); cmsg != NULL && cmsg->cmsg_len > 0; cmsg = WSA_CMSG_NXTHDR(&info->msg, cmsg))
+  {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_COALESCED_INFO)
+    {
+      DWORD segment = *(DWORD*)WSA_CMSG_DATA(cmsg);
+      if (segment > 0)
+        return (numBytes + segment - 1) / segment;
+    }
+  }
+#endif
+  return numBytes > 0 ? 1 : 0;
+}
+
+static void __stdcall udp_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  udp_info_t* info = (udp_info_t*)overlapped;
+
+  switch (info->kind)
+  {
+  case udp_info_kind_t::UDP_KIND_RECVFROM:
+    if (errorCode == ERROR_SUCCESS)
+    {
+      InterlockedAdd64(&udp_datagrams_in, udp_datagram_count(info, numBytes));
+      InterlockedAdd64(&udp_bytes_in, numBytes);
+      InterlockedIncrement64(&udp_recv_completions);
+    }
+    else
+    {
+      report_completion_error("Udp", "recv", info->socket, overlapped, errorCode);
+    }
+
+    if (!(g_running && errorCode != ERROR_OPERATION_ABORTED && udp_start_recv(info)))
+    {
+      InterlockedDecrement(&udp_recvs_outstanding);
+    }
+    break;
+
+  case udp_info_kind_t::UDP_KIND_SENDTO:
+    if (errorCode == ERROR_SUCCESS)
+    {
+      InterlockedAdd64(&udp_datagrams_out, numBytes / UDP_DATAGRAM_SIZE);
+      InterlockedIncrement64(&udp_send_completions);
+    }
+    else
+    {
+      report_completion_error("Udp", "send", info->socket, overlapped, errorCode);
+    }
+
+    if (!(g_running && errorCode != ERROR_OPERATION_ABORTED && udp_start_send(info)))
+    {
+      InterlockedDecrement(&udp_sends_outstanding);
+    }
+    break;
+  }
+}
+
+static bool udp_start_recv(udp_info_t* info)
+{
+  memset(&info->ov, 0, sizeof(OVERLAPPED));
+  info->fault_key = fault_key(info->index, (unsigned)info->kind, ++info->ops);
+  memset(info->control, 0, sizeof(info->control));
+
+  info->data.buf = info->buf;
+  info->data.len = UDP_RECV_BUFFER_SIZE;
+  info->msg.name = (LPSOCKADDR)&info->from;
+  info->msg.namelen = sizeof(info->from);
+  info->msg.lpBuffers = &info->data;
+  info->msg.dwBufferCount = 1;
+  info->msg.Control.buf = info->control;
+  info->msg.Control.len = sizeof(info->control);
+  info->msg.dwFlags = 0;
+
+  DWORD bytesReceived;
+  if (g_WSARecvMsg(info->socket, &info->msg, &bytesReceived, &info->ov, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    if (error != WSA_IO_PENDING)
+    {
+      report_error("Udp", "start recv", error);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool udp_start_send(udp_info_t* info)
+{
+  memset(&info->ov, 0, sizeof(OVERLAPPED));
+  info->fault_key = fault_key(info->index, (unsigned)info->kind, ++info->ops);
+
+  // with send offload the stack cuts the buffer into UDP_DATAGRAM_SIZE datagrams
+  info->data.buf = info->buf;
+  info->data.len = udp_send_offload ? UDP_SEND_BUFFER_SIZE : UDP_DATAGRAM_SIZE;
+
+  DWORD bytesSent;
+  if (WSASendTo(info->socket, &info->data, 1, &bytesSent, 0, (sockaddr*)&udp_server_addr, udp_server_addr_len, &info->ov, NULL) != 0)
+  {
+    DWORD error = WSAGetLastError();
+    if (error != WSA_IO_PENDING)
+    {
+      report_error("Udp", "start send", error);
+      return false;
+    }
+  }
+  return true;
+}
+
+// infos and buffers for depth operations of one kind, all from one arena
+static arena_t* udp_create_infos(udp_info_kind_t kind, SOCKET s, int depth, DWORD buffer_size, udp_info_t** infos)
+{
+  arena_t* arena = arena_create(depth * (sizeof(udp_info_t) + buffer_size + 32));
+  if (arena == NULL)
+  {
+    tsprintf("Udp: out of memory\n");
+    return NULL;
+  }
+
+  for (int i = 0; i < depth; i++)
+  {
+    infos[i] = (udp_info_t*)arena_alloc(arena, sizeof(udp_info_t));
+    char* buf = (char*)arena_alloc(arena, buffer_size);
+
+    // the arena is sized for all of these, so a miss means the size is out of date
+    if (infos[i] == NULL || buf == NULL)
+    {
+      tsprintf("Udp: context arena of %d bytes is too small\n", (int)arena->size);
+      arena_destroy(arena);
+      return NULL;
+    }
+
+    infos[i]->kind = kind;
+    infos[i]->index = i;
+    infos[i]->socket = s;
+    infos[i]->buf = buf;
+  }
+
+  tsprintf("Udp: %d %s contexts in %d arena bytes\n", depth, kind == udp_info_kind_t::UDP_KIND_RECVFROM ? "recv" : "send", (int)arena->used);
+  return arena;
+}
+
+// closing the socket aborts what is still posted; wait for those completions before the arena goes
+static void udp_close_and_drain(SOCKET* s, volatile LONG* outstanding, arena_t* arena)
+{
+  closesocket(*s);
+  *s = INVALID_SOCKET;
+
+  for (int i = 0; i < 1000 && *outstanding > 0; i++)
+  {
+    SleepEx(1, true);
+  }
+
+  if (*outstanding > 0)
+  {
+    tsprintf("Udp: %d operations still outstanding; leaking their arena\n", *outstanding);
+  }
+  else
+  {
+    arena_destroy(arena);
+  }
+}
+
+static SOCKET udp_create_socket()
+{
+  SOCKET s = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+  if (s == INVALID_SOCKET)
+  {
+    tsprintf("Udp: unable to create socket:\n");
+    printwindowserror(WSAGetLastError());
+    return INVALID_SOCKET;
+  }
+
+  if (!BIND_COMPLETION(s, udp_completion_routine))
+  {
+    tsprintf("Udp: unable to bind io completion callback:\n");
+    printwindowserror(GetLastError());
+    closesocket(s);
+    return INVALID_SOCKET;
+  }
+
+  int size = UDP_SOCKET_BUFFER_SIZE;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+  setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size));
+  return s;
+}
+
+DWORD WINAPI UdpServerThread(LPVOID data)
+{
+  command_queue_attach(&g_serverCommands, command_wakeup_only);
+
+  udp_server_socket = udp_create_socket();
+  if (udp_server_socket == INVALID_SOCKET)
+  {
+    g_running = false;
+    command_queue_detach(&g_serverCommands);
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t addr_len = sizeof(addr);
+  if (bind(udp_server_socket, (sockaddr*)&addr, sizeof(addr)) != 0
+    || getsockname(udp_server_socket, (sockaddr*)&addr, &addr_len) != 0)
+  {
+    tsprintf("Udp: unable to bind server socket:\n");
+    printwindowserror(WSAGetLastError());
+    closesocket(udp_server_socket);
+    g_running = false;
+    command_queue_detach(&g_serverCommands);
+    return EXIT_FAILURE;
+  }
+
+#ifdef UDP_RECV_MAX_COALESCED_SIZE
+  DWORD coalesced = UDP_RECV_BUFFER_SIZE;
+  udp_recv_coalescing = setsockopt(udp_server_socket, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (const char*)&coalesced, sizeof(coalesced)) == 0;
+#endif
+
+  udp_info_t* infos[UDP_RECV_DEPTH];
+  arena_t* arena = udp_create_infos(udp_info_kind_t::UDP_KIND_RECVFROM, udp_server_socket, UDP_RECV_DEPTH, UDP_RECV_BUFFER_SIZE, infos);
+  if (arena == NULL)
+  {
+    closesocket(udp_server_socket);
+    g_running = false;
+    command_queue_detach(&g_serverCommands);
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < UDP_RECV_DEPTH; i++)
+  {
+    InterlockedIncrement(&udp_recvs_outstanding);
+    if (!udp_start_recv(infos[i]))
+    {
+      InterlockedDecrement(&udp_recvs_outstanding);
+    }
+  }
+
+  // publishing the port lets the client start
+  getnameinfo((sockaddr*)&addr, addr_len, g_serverHost, NI_MAXHOST, g_serverPort, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+  tsprintf("Udp: server socket %d on %s:%s, receive coalescing %s\n", udp_server_socket, g_serverHost, g_serverPort, udp_recv_coalescing ? "on" : "off");
+
+  DWORD start = GetTickCount();
+  DWORD last = start;
+  LONG64 last_in = 0, last_out = 0;
+
+  while (g_running)
+  {
+    SleepEx(1000, true);
+
+    DWORD now = GetTickCount();
+    double secs = now > last ? (now - last) / 1000.0 : 1.0;
+    LONG64 in = udp_datagrams_in, out = udp_datagrams_out;
+
+    tsprintf("Udp: %.0f pps sent, %.0f pps received\n", (out - last_out) / secs, (in - last_in) / secs);
+
+    last = now;
+    last_in = in;
+    last_out = out;
+  }
+
+  double total_secs = (GetTickCount() - start) / 1000.0;
+  if (total_secs <= 0.0)
+    total_secs = 1.0;
+
+  tsprintf("Udp: total %lld datagrams sent in %lld sends, %lld received in %lld completions; %.0f pps received, %.1f MB/s\n",
+    udp_datagrams_out, udp_send_completions, udp_datagrams_in, udp_recv_completions,
+    udp_datagrams_in / total_secs, udp_bytes_in / total_secs / (1024.0 * 1024.0));
+
+  udp_close_and_drain(&udp_server_socket, &udp_recvs_outstanding, arena);
+
+  tsprintf("Udp: server exiting successfully\n");
+  command_queue_detach(&g_serverCommands);
+  return EXIT_SUCCESS;
+}
+
+DWORD WINAPI UdpClientThread(LPVOID data)
+{
+  command_queue_attach(&g_clientCommands, command_wakeup_only);
+
+  while (g_running && g_serverPort[0] == 0)
+  {
+    SleepEx(1, true);
+  }
+
+  if (!g_running)
+  {
+    command_queue_detach(&g_clientCommands);
+    return EXIT_SUCCESS;
+  }
+
+  if (!resolve_endpoint("127.0.0.1", g_serverPort, &udp_server_addr, &udp_server_addr_len))
+  {
+    tsprintf("Udp: unable to get address info for %s:%s:\n", g_serverHost, g_serverPort);
+    printwindowserror(WSAGetLastError());
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+
+  udp_client_socket = udp_create_socket();
+  if (udp_client_socket == INVALID_SOCKET)
+  {
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+
+#ifdef UDP_SEND_MSG_SIZE
+  DWORD segment = UDP_DATAGRAM_SIZE;
+  udp_send_offload = setsockopt(udp_client_socket, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (const char*)&segment, sizeof(segment)) == 0;
+#endif
+
+  udp_info_t* infos[UDP_SEND_DEPTH];
+  arena_t* arena = udp_create_infos(udp_info_kind_t::UDP_KIND_SENDTO, udp_client_socket, UDP_SEND_DEPTH, UDP_SEND_BUFFER_SIZE, infos);
+  if (arena == NULL)
+  {
+    closesocket(udp_client_socket);
+    command_queue_detach(&g_clientCommands);
+    return EXIT_FAILURE;
+  }
+
+  tsprintf("Udp: client sending %d byte datagrams, send offload %s\n", UDP_DATAGRAM_SIZE, udp_send_offload ? "on" : "off");
+
+  for (int i = 0; i < UDP_SEND_DEPTH; i++)
+  {
+    memset(infos[i]->buf, 'U', UDP_SEND_BUFFER_SIZE);
+
+    InterlockedIncrement(&udp_sends_outstanding);
+    if (!udp_start_send(infos[i]))
+    {
+      InterlockedDecrement(&udp_sends_outstanding);
+    }
+  }
+
+  while (g_running)
+  {
+    SleepEx(1000, true);
+  }
+
+  udp_close_and_drain(&udp_client_socket, &udp_sends_outstanding, arena);
+
+  tsprintf("Udp: client exiting with success\n");
+  command_queue_detach(&g_clientCommands);
+  return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include "pch.h"
+#include "Profile.h"
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -6,6 +7,8 @@ constexpr auto TSP_BUF_SIZE = 1024;
 
 int tsprintf(const char* format, ...)
 {
+  PROFILE_SCOPE(PROFILE_LOG);
+
   va_list args;
   char buffer[TSP_BUF_SIZE];
   memset(buffer, 0, TSP_BUF_SIZE);
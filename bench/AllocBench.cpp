@@ -0,0 +1,197 @@
+#include "pch.h"
+#include "Bench.h"
+#include "Connection.h"
+#include <stdio.h>
+
+// context allocation: the malloc per operation alloc_iocp() used to do, the
+// per-connection arena that replaced it, and a free list as the pooled alternative;
+// the contexts are ServerThread's own, and arenas are sized as create_connection() sizes them
+
+static iocp_info_t* malloc_info()
+{
+  iocp_info_t* info = (iocp_info_t*)malloc(sizeof(iocp_info_t));
+  if (info != NULL)
+  {
+    memset(info, 0, sizeof(iocp_info_t));
+  }
+  return info;
+}
+
+static uint64_t bench_malloc_info(uint64_t iterations)
+{
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    iocp_info_t* info = malloc_info();
+    if (info == NULL)
+    {
+      fprintf(stderr, "alloc: out of memory\n");
+      return BENCH_FAILED;
+    }
+    info->kind = (iocp_info_kind_t)(i & 3);
+    bench_keep(info);
+    free(info);
+  }
+  return bench_now_ns() - start;
+}
+
+// one connection's lifetime: state, two buffers, accept/recv/send/disconnect infos
+static uint64_t bench_malloc_connection(uint64_t iterations)
+{
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    connection_t* conn = (connection_t*)calloc(1, sizeof(connection_t));
+    char* read_buffer = (char*)calloc(1, READ_BUFFER_SIZE);
+    char* print_buffer = (char*)calloc(1, READ_BUFFER_SIZE);
+
+    iocp_info_t* infos[4];
+    bool allocated = conn != NULL && read_buffer != NULL && print_buffer != NULL;
+    for (int j = 0; j < 4; j++)
+    {
+      infos[j] = malloc_info();
+      allocated = allocated && infos[j] != NULL;
+      bench_keep(infos[j]);
+    }
+    for (int j = 0; j < 4; j++)
+    {
+      free(infos[j]);
+    }
+
+    free(print_buffer);
+    free(read_buffer);
+    free(conn);
+
+    if (!allocated)
+    {
+      fprintf(stderr, "alloc: out of memory\n");
+      return BENCH_FAILED;
+    }
+  }
+  return bench_now_ns() - start;
+}
+
+static uint64_t bench_arena_connection(uint64_t iterations)
+{
+  size_t size = connection_arena_size(false);
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    arena_t* arena = arena_create(size);
+    if (arena == NULL)
+    {
+      fprintf(stderr, "alloc: out of memory\n");
+      return BENCH_FAILED;
+    }
+
+    connection_t* conn = (connection_t*)arena_alloc(arena, sizeof(connection_t));
+    if (conn != NULL)
+    {
+      conn->arena = arena;
+      conn->read_buffer = (char*)arena_alloc(arena, READ_BUFFER_SIZE);
+      conn->print_buffer = (char*)arena_alloc(arena, READ_BUFFER_SIZE);
+    }
+
+    for (int j = 0; j < 4; j++)
+    {
+      bench_keep(arena_alloc(arena, sizeof(iocp_info_t)));
+    }
+
+    // connection_arena_size() covers all of these, so a miss means it is out of date
+    bool fits = arena->failed == 0;
+    arena_destroy(arena);
+    if (!fits)
+    {
+      fprintf(stderr, "alloc: connection arena of %zu bytes is too small\n", size);
+      return BENCH_FAILED;
+    }
+  }
+  return bench_now_ns() - start;
+}
+
+// connection_iocp() with a slot: the recv and send infos are reused per post
+static uint64_t bench_slot_reuse(uint64_t iterations)
+{
+  arena_t* arena = arena_create(connection_arena_size(false));
+  iocp_info_t* slot = arena != NULL ? (iocp_info_t*)arena_alloc(arena, sizeof(iocp_info_t)) : NULL;
+  if (slot == NULL)
+  {
+    fprintf(stderr, "alloc: out of memory\n");
+    arena_destroy(arena);
+    return BENCH_FAILED;
+  }
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    memset(&slot->ov, 0, sizeof(OVERLAPPED));
+    slot->kind = (iocp_info_kind_t)(i & 3);
+    bench_keep(slot);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  arena_destroy(arena);
+  return elapsed;
+}
+
+typedef struct bench_free_node_t
+{
+  bench_free_node_t* next;
+} bench_free_node_t;
+
+static void free_list_destroy(bench_free_node_t* free_list)
+{
+  while (free_list != NULL)
+  {
+    bench_free_node_t* next = free_list->next;
+    free(free_list);
+    free_list = next;
+  }
+}
+
+static uint64_t bench_freelist_info(uint64_t iterations)
+{
+  constexpr int POOL_SIZE = 64;
+  bench_free_node_t* free_list = NULL;
+  for (int i = 0; i < POOL_SIZE; i++)
+  {
+    bench_free_node_t* node = (bench_free_node_t*)malloc_info();
+    if (node == NULL)
+    {
+      fprintf(stderr, "alloc: out of memory\n");
+      free_list_destroy(free_list);
+      return BENCH_FAILED;
+    }
+    node->next = free_list;
+    free_list = node;
+  }
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    iocp_info_t* info = (iocp_info_t*)free_list;
+    free_list = free_list->next;
+    memset(info, 0, sizeof(iocp_info_t));
+    info->kind = (iocp_info_kind_t)(i & 3);
+    bench_keep(info);
+
+    bench_free_node_t* node = (bench_free_node_t*)info;
+    node->next = free_list;
+    free_list = node;
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  free_list_destroy(free_list);
+  return elapsed;
+}
+
+const bench_t g_alloc_benches[] =
+{
+  { "alloc/malloc-info", bench_malloc_info, 2000000, NULL },
+  { "alloc/freelist-info", bench_freelist_info, 2000000, NULL },
+  { "alloc/slot-reuse", bench_slot_reuse, 2000000, NULL },
+  { "alloc/malloc-connection", bench_malloc_connection, 500000, NULL },
+  { "alloc/arena-connection", bench_arena_connection, 500000, NULL },
+  { NULL, NULL, 0, NULL }
+};
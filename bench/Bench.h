@@ -0,0 +1,42 @@
+#ifndef SERVER_LINGER_TEST_BENCH_H
+#define SERVER_LINGER_TEST_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// runs the given number of operations and returns the nanoseconds spent in the
+// timed part; setup and teardown stay outside the clock
+typedef uint64_t (*bench_fn_t)(uint64_t iterations);
+
+// returned instead of a time when setup fails or the run cannot complete; the
+// suite stops there and exits non-zero rather than report a figure for it
+constexpr uint64_t BENCH_FAILED = UINT64_MAX;
+
+typedef struct bench_t
+{
+  const char* name;
+  bench_fn_t run;
+  uint64_t iterations;
+  void (*report)();  // optional; prints extra figures after the last repetition
+} bench_t;
+
+// each list ends with an entry whose name is NULL
+extern const bench_t g_alloc_benches[];
+extern const bench_t g_dispatch_benches[];
+extern const bench_t g_socket_benches[];  // only with SLT_WITH_OPENSSL
+
+inline uint64_t bench_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// keeps the compiler from optimising away work whose result is otherwise unused
+inline void bench_keep(const void* p)
+{
+  asm volatile("" : : "g"(p) : "memory");
+}
+
+#endif
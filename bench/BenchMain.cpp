@@ -0,0 +1,72 @@
+#include "Bench.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// every benchmark runs once to warm up and then this many times; the median is
+// what to compare between builds, min and max show how noisy the machine was
+constexpr int BENCH_REPEATS = 7;
+
+static bool run_bench(const bench_t* bench)
+{
+  if (bench->run(bench->iterations) == BENCH_FAILED)
+  {
+    fprintf(stderr, "%s: failed\n", bench->name);
+    return false;
+  }
+
+  std::vector<double> ns_per_op;
+  for (int i = 0; i < BENCH_REPEATS; i++)
+  {
+    uint64_t elapsed = bench->run(bench->iterations);
+    if (elapsed == BENCH_FAILED)
+    {
+      fprintf(stderr, "%s: failed on repetition %d\n", bench->name, i + 1);
+      return false;
+    }
+    ns_per_op.push_back((double)elapsed / (double)bench->iterations);
+  }
+  std::sort(ns_per_op.begin(), ns_per_op.end());
+
+  double median = ns_per_op[BENCH_REPEATS / 2];
+  printf("%-28s %10llu %12.1f %12.1f %12.1f %14.0f\n", bench->name, (unsigned long long)bench->iterations,
+    median, ns_per_op.front(), ns_per_op.back(), median > 0 ? 1e9 / median : 0.0);
+
+  if (bench->report != NULL)
+  {
+    bench->report();
+  }
+  fflush(stdout);
+  return true;
+}
+
+// usage: slt_bench [filter]; runs only the benchmarks whose name contains filter
+int main(int argc, char* argv[])
+{
+  const char* filter = argc > 1 ? argv[1] : NULL;
+  const bench_t* lists[] =
+  {
+    g_alloc_benches,
+    g_dispatch_benches,
+#ifdef SLT_WITH_OPENSSL
+    g_socket_benches,
+#endif
+  };
+
+  printf("%-28s %10s %12s %12s %12s %14s\n", "benchmark", "iterations", "ns/op", "min", "max", "ops/s");
+
+  for (const bench_t* list : lists)
+  {
+    for (const bench_t* bench = list; bench->name != NULL; bench++)
+    {
+      if ((filter == NULL || strstr(bench->name, filter) != NULL) && !run_bench(bench))
+      {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+#include "pch.h"
+#include "Bench.h"
+#include "Commands.h"
+#include "Connection.h"
+#include "Fault.h"
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+// completion dispatch: the indirect call the thread pool makes into the
+// COMPLETION_ROUTINE wrapper, through fault_deliver() and the switch on the info
+// kind behind it, and the command queue hop that posts work onto an owner thread
+
+static uint64_t handled[4];
+
+static void WINAPI bench_completion_routine(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped)
+{
+  iocp_info_t* info = (iocp_info_t*)overlapped;
+
+  switch (info->kind)
+  {
+  case iocp_info_kind_t::IOCP_KIND_ACCEPT:
+    handled[0] += errorCode == 0;
+    break;
+  case iocp_info_kind_t::IOCP_KIND_RECV:
+    handled[1] += numBytes;
+    break;
+  case iocp_info_kind_t::IOCP_KIND_SEND:
+    handled[2] += numBytes;
+    break;
+  case iocp_info_kind_t::IOCP_KIND_DISCONNECT:
+    handled[3]++;
+    break;
+  }
+}
+
+static uint64_t run_dispatch(uint64_t iterations)
+{
+  constexpr size_t COMPLETIONS = 1024;
+  std::vector<iocp_info_t> completions(COMPLETIONS);
+  for (size_t i = 0; i < COMPLETIONS; i++)
+  {
+    // recv/send dominate, as on a live connection
+    completions[i].kind = (iocp_info_kind_t)((i * 7 + i / 3) % 4);
+    completions[i].fault_key = fault_key(i / 4, (unsigned)completions[i].kind, i);
+  }
+
+  // volatile so the call stays indirect, as it is from the thread pool
+  LPOVERLAPPED_COMPLETION_ROUTINE volatile dispatch = COMPLETION_ROUTINE(bench_completion_routine);
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    dispatch(0, (DWORD)i & 0xfff, &completions[i & (COMPLETIONS - 1)].ov);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_keep(handled);
+  return elapsed;
+}
+
+static uint64_t bench_dispatch_switch(uint64_t iterations)
+{
+  return run_dispatch(iterations);
+}
+
+// injection on with every chance at zero: the per-completion cost of the fault
+// layer's decisions and logical clock, with nothing actually injected
+static uint64_t bench_dispatch_fault(uint64_t iterations)
+{
+  fault_config_t saved = g_fault;
+  g_fault.enabled = true;
+  g_fault.delay_permille = 0;
+  g_fault.reorder_permille = 0;
+  g_fault.fail_permille = 0;
+
+  uint64_t elapsed = run_dispatch(iterations);
+
+  g_fault = saved;
+  return elapsed;
+}
+
+// preallocated commands, so this is the queue alone without command_post()'s malloc
+static bool create_commands(std::vector<command_t*>& commands)
+{
+  for (size_t i = 0; i < commands.size(); i++)
+  {
+    commands[i] = command_create(command_kind_t::COMMAND_SEND, INVALID_SOCKET, NULL, 0);
+    if (commands[i] == NULL)
+    {
+      fprintf(stderr, "dispatch: out of memory\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static void destroy_commands(std::vector<command_t*>& commands)
+{
+  for (command_t* command : commands)
+  {
+    free(command);
+  }
+}
+
+static uint64_t bench_mpsc_local(uint64_t iterations)
+{
+  mpsc_queue_t queue;
+  mpsc_init(&queue);
+  std::vector<command_t*> commands(1, NULL);
+  if (!create_commands(commands))
+  {
+    destroy_commands(commands);
+    return BENCH_FAILED;
+  }
+  uint64_t sum = 0;
+
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations; i++)
+  {
+    commands[0]->len = (size_t)i;
+    mpsc_push(&queue, &commands[0]->node);
+    command_t* popped = (command_t*)mpsc_pop(&queue);
+    sum += popped != NULL ? popped->len : 0;
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  bench_keep(&sum);
+  destroy_commands(commands);
+  return elapsed;
+}
+
+// one producer pushing to the consumer, which spins instead of waiting for an APC
+static uint64_t bench_mpsc_cross(uint64_t iterations)
+{
+  mpsc_queue_t queue;
+  mpsc_init(&queue);
+  std::vector<command_t*> commands(iterations, NULL);
+  if (!create_commands(commands))
+  {
+    destroy_commands(commands);
+    return BENCH_FAILED;
+  }
+
+  uint64_t start = bench_now_ns();
+  std::thread producer([&]()
+  {
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+      mpsc_push(&queue, &commands[i]->node);
+    }
+  });
+
+  uint64_t received = 0;
+  while (received < iterations)
+  {
+    if (mpsc_pop(&queue) != NULL)
+    {
+      received++;
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  producer.join();
+  destroy_commands(commands);
+  return elapsed;
+}
+
+// command_post() from another thread, as the console handler and the command
+// senders use it: allocation, push and the wakeup check, with the owner polling
+static uint64_t bench_command_post(uint64_t iterations)
+{
+  constexpr size_t PAYLOAD = 32;
+  char payload[PAYLOAD];
+  memset(payload, 'c', sizeof(payload));
+
+  command_queue_t queue;
+  command_queue_init(&queue, "bench");
+  std::atomic<bool> failed(false);
+
+  uint64_t start = bench_now_ns();
+  std::thread producer([&]()
+  {
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+      if (!command_post(&queue, command_kind_t::COMMAND_SEND, INVALID_SOCKET, payload, sizeof(payload)))
+      {
+        failed = true;
+        return;
+      }
+    }
+  });
+
+  uint64_t received = 0;
+  while (received < iterations && !failed)
+  {
+    mpsc_node_t* node = mpsc_pop(&queue.queue);
+    if (node != NULL)
+    {
+      free(node);
+      received++;
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  producer.join();
+
+  mpsc_node_t* node;
+  while ((node = mpsc_pop(&queue.queue)) != NULL)
+  {
+    free(node);
+  }
+
+  if (failed)
+  {
+    fprintf(stderr, "dispatch: command_post failed after %llu commands\n", (unsigned long long)received);
+    return BENCH_FAILED;
+  }
+  return elapsed;
+}
+
+const bench_t g_dispatch_benches[] =
+{
+  { "dispatch/switch", bench_dispatch_switch, 20000000, NULL },
+  { "dispatch/fault-enabled", bench_dispatch_fault, 20000000, NULL },
+  { "dispatch/mpsc-local", bench_mpsc_local, 10000000, NULL },
+  { "dispatch/mpsc-cross", bench_mpsc_cross, 2000000, NULL },
+  { "dispatch/command-post", bench_command_post, 2000000, NULL },
+  { NULL, NULL, 0, NULL }
+};
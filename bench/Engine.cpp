@@ -0,0 +1,26 @@
+#include "pch.h"
+#include "Fault.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+// what ServerLingerTest.cpp and Utils.cpp provide to the engine sources the
+// benchmarks link; fault injection stays off unless a benchmark turns it on
+fault_config_t g_fault =
+{
+  false,  // enabled
+  1,      // seed
+  0, 0,   // delay chance, max delay in completions
+  0,      // reorder chance
+  0, 0,   // failure chance, injected error
+  0,      // partial transfer chance
+  0       // reset (vs fin) chance on close
+};
+
+int tsprintf(const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int result = vfprintf(stderr, format, args);
+  va_end(args);
+  return result;
+}
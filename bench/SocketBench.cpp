@@ -0,0 +1,345 @@
+#include "pch.h"
+#include "Bench.h"
+#include "Tls.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// loopback TCP with blocking POSIX sockets in place of overlapped Winsock, carrying
+// records from the engine's own TLS stage: tls_queue() and tls_take_output() on
+// the way out and tls_recv() on the way in, as the client and server threads
+// call them; the numbers are for comparing engine changes, not against Windows
+
+constexpr size_t COALESCE_MESSAGE_SIZE = 32;
+constexpr size_t PING_SIZE = 64;
+
+// a connected pair on 127.0.0.1 with Nagle off on both ends, as the client runs
+static bool tcp_loopback_pair(int fds[2])
+{
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+  {
+    return false;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0
+    || getsockname(listener, (struct sockaddr*)&addr, &len) != 0)
+  {
+    close(listener);
+    return false;
+  }
+
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if (fds[0] < 0)
+  {
+    close(listener);
+    return false;
+  }
+
+  if (connect(fds[0], (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    close(fds[0]);
+    close(listener);
+    return false;
+  }
+
+  fds[1] = accept(listener, NULL, NULL);
+  close(listener);
+  if (fds[1] < 0)
+  {
+    close(fds[0]);
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return true;
+}
+
+static bool send_all(int fd, const char* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, data, len, 0);
+    if (sent <= 0)
+    {
+      return false;
+    }
+    data += sent;
+    len -= (size_t)sent;
+  }
+  return true;
+}
+
+// moves whatever from has written over to to through memory
+static bool tls_exchange(tls_session_t* from, tls_session_t* to, char* buf, bool* moved)
+{
+  size_t len;
+  while ((len = tls_take_output(from, buf, TLS_BUFFER_SIZE)) > 0)
+  {
+    *moved = true;
+    if (tls_recv(to, buf, len, TLS_BUFFER_SIZE) < 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// a loopback pair with a client session on fds[0] and a server session on
+// fds[1]; the handshake goes through memory so the clock only sees application data
+typedef struct tls_loopback_t
+{
+  int fds[2];
+  tls_session_t* client;
+  tls_session_t* server;
+} tls_loopback_t;
+
+static void tls_loopback_close(tls_loopback_t* loop)
+{
+  tls_destroy(loop->client);
+  tls_destroy(loop->server);
+  close(loop->fds[0]);
+  close(loop->fds[1]);
+}
+
+static bool tls_loopback_open(tls_loopback_t* loop, const char* name)
+{
+  // the contexts are kept for the rest of the run once they exist
+  static bool tls_ready = false;
+  if (!tls_ready && !(tls_ready = tls_init()))
+  {
+    fprintf(stderr, "%s: unable to set up TLS\n", name);
+    return false;
+  }
+
+  if (!tcp_loopback_pair(loop->fds))
+  {
+    fprintf(stderr, "%s: unable to create loopback pair\n", name);
+    return false;
+  }
+
+  // the client's ClientHello is already waiting when tls_create() returns
+  loop->client = tls_create(false);
+  loop->server = tls_create(true);
+
+  std::vector<char> buf(TLS_BUFFER_SIZE);
+  bool ok = loop->client != NULL && loop->server != NULL;
+  bool moved = true;
+  while (ok && moved && !(tls_handshake_done(loop->client) && tls_handshake_done(loop->server)))
+  {
+    moved = false;
+    ok = tls_exchange(loop->client, loop->server, buf.data(), &moved)
+      && tls_exchange(loop->server, loop->client, buf.data(), &moved);
+  }
+
+  if (!ok || !tls_handshake_done(loop->client) || !tls_handshake_done(loop->server))
+  {
+    fprintf(stderr, "%s: TLS handshake failed\n", name);
+    tls_loopback_close(loop);
+    return false;
+  }
+  return true;
+}
+
+// sends everything the session has queued; a full record can leave more behind
+static bool flush_tls(int fd, tls_session_t* session, char* buf)
+{
+  size_t len;
+  while ((len = tls_take_output(session, buf, TLS_BUFFER_SIZE)) > 0)
+  {
+    if (!send_all(fd, buf, len))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// reads one batch of ciphertext and hands the plaintext to handle() a chunk at a
+// time, calling tls_recv() again without new ciphertext until the session has
+// nothing left; 0 once the peer has closed, -1 if the read or the session failed
+template <typename Handler>
+static int recv_tls(int fd, tls_session_t* session, char* buf, Handler handle)
+{
+  ssize_t received = recv(fd, buf, TLS_BUFFER_SIZE, 0);
+  if (received <= 0)
+  {
+    return received == 0 ? 0 : -1;
+  }
+
+  int length = tls_recv(session, buf, (size_t)received, TLS_BUFFER_SIZE);
+  while (length > 0)
+  {
+    if (!handle(buf, (size_t)length))
+    {
+      return -1;
+    }
+    length = tls_recv(session, buf, 0, TLS_BUFFER_SIZE);
+  }
+  return length < 0 ? -1 : 1;
+}
+
+// decrypts until the sender closes; the clock stops once everything has arrived
+static void drain_tls(int fd, tls_session_t* session, uint64_t* plaintext)
+{
+  std::vector<char> buf(TLS_BUFFER_SIZE);
+  auto count = [plaintext](const char*, size_t len) { *plaintext += len; return true; };
+  while (recv_tls(fd, session, buf.data(), count) > 0)
+  {
+  }
+}
+
+static uint64_t send_coalesce(uint64_t iterations, bool coalesce)
+{
+  tls_loopback_t loop;
+  if (!tls_loopback_open(&loop, "coalesce"))
+  {
+    return BENCH_FAILED;
+  }
+
+  char message[COALESCE_MESSAGE_SIZE];
+  memset(message, 'm', sizeof(message));
+  std::vector<char> buf(TLS_BUFFER_SIZE);
+  uint64_t received = 0;
+
+  bool sent = true;
+  uint64_t start = bench_now_ns();
+  std::thread reader(drain_tls, loop.fds[1], loop.server, &received);
+  for (uint64_t i = 0; i < iterations && sent; i++)
+  {
+    if (!coalesce)
+    {
+      // one record per message, as when every write finds the send slot free
+      sent = tls_queue(loop.client, message, sizeof(message)) && flush_tls(loop.fds[0], loop.client, buf.data());
+    }
+    else if (!tls_queue(loop.client, message, sizeof(message)))
+    {
+      // the stage holds a full record; it goes out and the message starts the next
+      sent = flush_tls(loop.fds[0], loop.client, buf.data()) && tls_queue(loop.client, message, sizeof(message));
+    }
+  }
+  sent = sent && flush_tls(loop.fds[0], loop.client, buf.data());
+  shutdown(loop.fds[0], SHUT_WR);
+  reader.join();
+  uint64_t elapsed = bench_now_ns() - start;
+
+  tls_loopback_close(&loop);
+  if (!sent || received != iterations * sizeof(message))
+  {
+    fprintf(stderr, "coalesce: %llu of %llu bytes arrived\n", (unsigned long long)received,
+      (unsigned long long)(iterations * sizeof(message)));
+    return BENCH_FAILED;
+  }
+  return elapsed;
+}
+
+// one record per message
+static uint64_t bench_send_per_message(uint64_t iterations)
+{
+  return send_coalesce(iterations, false);
+}
+
+// messages queued into one record while a send would be in flight, as the client
+// does between send completions
+static uint64_t bench_send_coalesced(uint64_t iterations)
+{
+  return send_coalesce(iterations, true);
+}
+
+static std::vector<uint64_t> ping_samples;
+
+// the TLS echo test's server side: whatever decrypts is queued straight back
+static void echo_tls(int fd, tls_session_t* session)
+{
+  std::vector<char> buf(TLS_BUFFER_SIZE);
+  std::vector<char> out(TLS_BUFFER_SIZE);
+  auto echo = [session](const char* data, size_t len) { return tls_queue(session, data, len); };
+  while (recv_tls(fd, session, buf.data(), echo) > 0 && flush_tls(fd, session, out.data()))
+  {
+  }
+}
+
+// round trips of one small message; the echo side runs on its own thread
+static uint64_t bench_ping_pong(uint64_t iterations)
+{
+  tls_loopback_t loop;
+  if (!tls_loopback_open(&loop, "ping-pong"))
+  {
+    return BENCH_FAILED;
+  }
+
+  std::thread echo(echo_tls, loop.fds[1], loop.server);
+  char ping[PING_SIZE];
+  memset(ping, 'p', sizeof(ping));
+  std::vector<char> buf(TLS_BUFFER_SIZE);
+
+  ping_samples.clear();
+  ping_samples.reserve(iterations);
+
+  size_t echoed = 0;
+  auto count = [&echoed](const char*, size_t len) { echoed += len; return true; };
+
+  bool lost = false;
+  uint64_t start = bench_now_ns();
+  for (uint64_t i = 0; i < iterations && !lost; i++)
+  {
+    uint64_t sent = bench_now_ns();
+    lost = !tls_queue(loop.client, ping, sizeof(ping)) || !flush_tls(loop.fds[0], loop.client, buf.data());
+
+    echoed = 0;
+    while (!lost && echoed < sizeof(ping))
+    {
+      lost = recv_tls(loop.fds[0], loop.client, buf.data(), count) <= 0;
+    }
+
+    if (lost)
+    {
+      fprintf(stderr, "ping-pong: connection lost after %llu round trips\n", (unsigned long long)i);
+      break;
+    }
+    ping_samples.push_back(bench_now_ns() - sent);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  shutdown(loop.fds[0], SHUT_WR);
+  echo.join();
+  tls_loopback_close(&loop);
+  return lost ? BENCH_FAILED : elapsed;
+}
+
+static void report_ping_pong()
+{
+  if (ping_samples.empty())
+  {
+    return;
+  }
+
+  std::sort(ping_samples.begin(), ping_samples.end());
+  size_t count = ping_samples.size();
+  printf("%-28s rtt p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", "",
+    ping_samples[count / 2] / 1000.0, ping_samples[count * 99 / 100] / 1000.0,
+    ping_samples[count * 999 / 1000] / 1000.0, ping_samples[count - 1] / 1000.0);
+}
+
+const bench_t g_socket_benches[] =
+{
+  { "coalesce/per-message", bench_send_per_message, 200000, NULL },
+  { "coalesce/coalesced", bench_send_coalesced, 200000, NULL },
+  { "loopback/ping-pong", bench_ping_pong, 50000, report_ping_pong },
+  { NULL, NULL, 0, NULL }
+};
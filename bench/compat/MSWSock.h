@@ -0,0 +1 @@
+// everything the benchmarks need is in the WinSock2.h stand-in
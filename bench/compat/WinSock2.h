@@ -0,0 +1,195 @@
+#ifndef SERVER_LINGER_TEST_BENCH_WINSOCK2_H
+#define SERVER_LINGER_TEST_BENCH_WINSOCK2_H
+
+// POSIX stand-ins for the Win32 and Winsock declarations the engine's portable
+// pieces use, so the benchmarks compile the real headers and sources unchanged;
+// ServerLingerTest's pch.h finds this in place of the Windows SDK header
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#define WINAPI
+#define CALLBACK
+#define FALSE 0
+#define TRUE 1
+#define ERROR_SUCCESS 0
+
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint16_t USHORT;
+typedef uint32_t UINT32;
+typedef uintptr_t ULONG_PTR;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef void* HANDLE;
+
+typedef uintptr_t SOCKET;
+#define INVALID_SOCKET ((SOCKET)~(uintptr_t)0)
+#define SD_SEND SHUT_WR
+
+typedef struct linger LINGER;
+
+// same layout as the SDK's, so the engine's contexts have their Windows size
+typedef struct _OVERLAPPED
+{
+  ULONG_PTR Internal;
+  ULONG_PTR InternalHigh;
+  union
+  {
+    struct
+    {
+      DWORD Offset;
+      DWORD OffsetHigh;
+    };
+    PVOID Pointer;
+  };
+  HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef void (WINAPI* LPOVERLAPPED_COMPLETION_ROUTINE)(DWORD errorCode, DWORD numBytes, LPOVERLAPPED overlapped);
+typedef DWORD (WINAPI* LPTHREAD_START_ROUTINE)(LPVOID data);
+typedef void (CALLBACK* PAPCFUNC)(ULONG_PTR data);
+
+template <typename T> inline T min(T a, T b) { return b < a ? b : a; }
+template <typename T> inline T max(T a, T b) { return a < b ? b : a; }
+
+inline int closesocket(SOCKET s)
+{
+  return close((int)s);
+}
+
+inline void Sleep(DWORD ms)
+{
+  usleep(ms * 1000);
+}
+
+inline LONG InterlockedIncrement(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(volatile LONG* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchange(volatile LONG* p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedCompareExchange(volatile LONG* p, LONG v, LONG comparand) { return __sync_val_compare_and_swap(p, comparand, v); }
+inline LONG64 InterlockedIncrement64(volatile LONG64* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG64 InterlockedAdd64(volatile LONG64* p, LONG64 v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+
+typedef pthread_rwlock_t SRWLOCK;
+#define SRWLOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+
+inline void InitializeSRWLock(SRWLOCK* lock) { pthread_rwlock_init(lock, NULL); }
+inline void AcquireSRWLockExclusive(SRWLOCK* lock) { pthread_rwlock_wrlock(lock); }
+inline void ReleaseSRWLockExclusive(SRWLOCK* lock) { pthread_rwlock_unlock(lock); }
+inline void AcquireSRWLockShared(SRWLOCK* lock) { pthread_rwlock_rdlock(lock); }
+inline void ReleaseSRWLockShared(SRWLOCK* lock) { pthread_rwlock_unlock(lock); }
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline void InitializeCriticalSection(CRITICAL_SECTION* lock) { pthread_mutex_init(lock, NULL); }
+inline void DeleteCriticalSection(CRITICAL_SECTION* lock) { pthread_mutex_destroy(lock); }
+inline void EnterCriticalSection(CRITICAL_SECTION* lock) { pthread_mutex_lock(lock); }
+inline void LeaveCriticalSection(CRITICAL_SECTION* lock) { pthread_mutex_unlock(lock); }
+
+// clocks for the TLS stage's own statistics; performance counter ticks are
+// nanoseconds and FILETIMEs are 100 ns units, as on Windows
+typedef union _LARGE_INTEGER
+{
+  struct
+  {
+    DWORD LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+  struct
+  {
+    DWORD LowPart;
+    DWORD HighPart;
+  };
+  uint64_t QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _FILETIME
+{
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+} FILETIME;
+
+inline uint64_t compat_clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+inline DWORD GetTickCount() { return (DWORD)(compat_clock_ns(CLOCK_MONOTONIC) / 1000000); }
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency) { frequency->QuadPart = 1000000000; return TRUE; }
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter) { counter->QuadPart = (LONGLONG)compat_clock_ns(CLOCK_MONOTONIC); return TRUE; }
+
+// all of the CPU time is reported as user time
+inline BOOL compat_cpu_times(clockid_t clock, FILETIME* created, FILETIME* exited, FILETIME* kernel, FILETIME* user)
+{
+  uint64_t units = compat_clock_ns(clock) / 100;
+  memset(created, 0, sizeof(FILETIME));
+  memset(exited, 0, sizeof(FILETIME));
+  memset(kernel, 0, sizeof(FILETIME));
+  user->dwLowDateTime = (DWORD)units;
+  user->dwHighDateTime = (DWORD)(units >> 32);
+  return TRUE;
+}
+
+#define WT_EXECUTELONGFUNCTION 0x10
+
+inline BOOL QueueUserWorkItem(LPTHREAD_START_ROUTINE routine, PVOID data, ULONG flags)
+{
+  (void)flags;
+  std::thread(routine, data).detach();
+  return TRUE;
+}
+
+// there are no APCs here; a command queue in a benchmark is never attached, so
+// its owner polls instead of being woken
+#define DUPLICATE_SAME_ACCESS 0x2
+
+inline HANDLE GetCurrentProcess() { return NULL; }
+inline HANDLE GetCurrentThread() { return NULL; }
+inline BOOL CloseHandle(HANDLE handle) { (void)handle; return TRUE; }
+
+// the handles above are pseudo-handles for the caller, as on Windows
+inline BOOL GetThreadTimes(HANDLE thread, FILETIME* created, FILETIME* exited, FILETIME* kernel, FILETIME* user)
+{
+  (void)thread;
+  return compat_cpu_times(CLOCK_THREAD_CPUTIME_ID, created, exited, kernel, user);
+}
+
+inline BOOL GetProcessTimes(HANDLE process, FILETIME* created, FILETIME* exited, FILETIME* kernel, FILETIME* user)
+{
+  (void)process;
+  return compat_cpu_times(CLOCK_PROCESS_CPUTIME_ID, created, exited, kernel, user);
+}
+
+inline BOOL DuplicateHandle(HANDLE process, HANDLE source, HANDLE target_process, HANDLE* target, DWORD access, BOOL inherit, DWORD options)
+{
+  (void)process; (void)source; (void)target_process; (void)access; (void)inherit; (void)options;
+  *target = NULL;
+  return FALSE;
+}
+
+inline DWORD QueueUserAPC(PAPCFUNC routine, HANDLE thread, ULONG_PTR data)
+{
+  (void)routine; (void)thread; (void)data;
+  return 0;
+}
+
+#endif